@@ -0,0 +1,287 @@
+/* Two-lock blocking bounded queue with coalesced wakeups */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bq.h"
+
+/* The queue header needs cache line alignment, so it uses libc */
+#define INTERNAL 1
+#include "harness.h"
+
+#define CACHE_LINE 64
+
+/* Longest a woken consumer waits for the rest of a batch */
+#define BQ_LINGER_US 200
+
+struct bq {
+    /* Consumer side */
+    pthread_mutex_t head_lock __attribute__((aligned(CACHE_LINE)));
+    pthread_cond_t not_empty;
+    element_t *head; /* Dummy, its successor holds the first string */
+    size_t consumers_waiting;
+
+    /* Producer side */
+    pthread_mutex_t tail_lock __attribute__((aligned(CACHE_LINE)));
+    pthread_cond_t not_full;
+    element_t *tail;
+    size_t producers_waiting;
+
+    /* Shared */
+    size_t count __attribute__((aligned(CACHE_LINE)));
+    size_t capacity, batch;
+    int closed;
+    size_t wakeups;
+};
+
+/* The link to the next node lives in list.next, the rest of list is unused */
+static inline element_t *next_of(element_t *e)
+{
+    struct list_head *l = __atomic_load_n(&e->list.next, __ATOMIC_ACQUIRE);
+    return l ? list_entry(l, element_t, list) : NULL;
+}
+
+static element_t *node_new(char *value)
+{
+    element_t *e = test_malloc(sizeof(element_t));
+    if (!e)
+        return NULL;
+    e->value = value;
+    e->interned = false;
+    e->list.next = NULL;
+    e->list.prev = NULL;
+    return e;
+}
+
+/* Absolute CLOCK_MONOTONIC deadline timeout_us from now */
+static struct timespec deadline(long timeout_us)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_us / 1000000;
+    ts.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+static bool earlier(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Wait on cond, return false once the deadline passed */
+static bool wait_until(pthread_cond_t *cond,
+                       pthread_mutex_t *lock,
+                       const struct timespec *ts)
+{
+    if (!ts) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, lock, ts) != ETIMEDOUT;
+}
+
+static bool cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr))
+        return false;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    bool ok = !pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return ok;
+}
+
+bq_t *bq_new(size_t capacity, size_t batch)
+{
+    if (!capacity || !batch)
+        return NULL;
+
+    bq_t *q;
+    if (posix_memalign((void **) &q, CACHE_LINE, sizeof(bq_t)))
+        return NULL;
+    memset(q, 0, sizeof(bq_t));
+    q->head = q->tail = node_new(NULL);
+    if (!q->head) {
+        free(q);
+        return NULL;
+    }
+    if (!cond_init(&q->not_empty) || !cond_init(&q->not_full)) {
+        test_free(q->head);
+        free(q);
+        return NULL;
+    }
+    pthread_mutex_init(&q->head_lock, NULL);
+    pthread_mutex_init(&q->tail_lock, NULL);
+    q->capacity = capacity;
+    q->batch = batch < capacity ? batch : capacity;
+    return q;
+}
+
+void bq_free(bq_t *q)
+{
+    if (!q)
+        return;
+
+    /* Every node past the dummy still owns its string */
+    element_t *e = q->head, *next;
+    for (bool dummy = true; e; e = next, dummy = false) {
+        next = next_of(e);
+        if (!dummy)
+            test_free(e->value);
+        test_free(e);
+    }
+    pthread_mutex_destroy(&q->head_lock);
+    pthread_mutex_destroy(&q->tail_lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q);
+}
+
+bool bq_insert_tail(bq_t *q, const char *s, long timeout_us)
+{
+    if (!s)
+        return false;
+
+    char *value = test_strdup(s);
+    element_t *node = value ? node_new(value) : NULL;
+    if (!node) {
+        test_free(value);
+        return false;
+    }
+
+    struct timespec ts;
+    if (timeout_us >= 0)
+        ts = deadline(timeout_us);
+
+    pthread_mutex_lock(&q->tail_lock);
+    bool ok = true;
+    __atomic_fetch_add(&q->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    while (ok && !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&q->count, __ATOMIC_SEQ_CST) >= q->capacity)
+        ok = wait_until(&q->not_full, &q->tail_lock,
+                        timeout_us >= 0 ? &ts : NULL);
+    __atomic_fetch_sub(&q->producers_waiting, 1, __ATOMIC_RELAXED);
+
+    if (!ok || __atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&q->tail_lock);
+        test_free(value);
+        test_free(node);
+        return false;
+    }
+
+    __atomic_store_n(&q->tail->list.next, &node->list, __ATOMIC_RELEASE);
+    q->tail = node;
+    size_t count = __atomic_add_fetch(&q->count, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->tail_lock);
+
+    /*
+     * Consumers only sleep on an empty queue.  The first string wakes them,
+     * so that none waits on a batch that may never fill, and the last of a
+     * batch wakes those lingering for it.
+     */
+    if ((count == 1 || count == q->batch) &&
+        __atomic_load_n(&q->consumers_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->head_lock);
+        pthread_cond_broadcast(&q->not_empty);
+        pthread_mutex_unlock(&q->head_lock);
+        __atomic_fetch_add(&q->wakeups, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+size_t bq_remove_head_n(bq_t *q, element_t **out, size_t n, long timeout_us)
+{
+    if (!n)
+        return 0;
+
+    struct timespec ts;
+    if (timeout_us >= 0)
+        ts = deadline(timeout_us);
+
+    pthread_mutex_lock(&q->head_lock);
+    bool ok = true, slept = false;
+    __atomic_fetch_add(&q->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    while (ok && !__atomic_load_n(&q->count, __ATOMIC_SEQ_CST) &&
+           !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+        ok = wait_until(&q->not_empty, &q->head_lock,
+                        timeout_us >= 0 ? &ts : NULL);
+        slept = true;
+    }
+
+    /* Woken by the first string, give the rest of a batch a moment */
+    if (ok && slept && q->batch > 1) {
+        struct timespec linger = deadline(BQ_LINGER_US);
+        if (timeout_us >= 0 && earlier(&ts, &linger))
+            linger = ts;
+        while (__atomic_load_n(&q->count, __ATOMIC_SEQ_CST) < q->batch &&
+               !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE) &&
+               wait_until(&q->not_empty, &q->head_lock, &linger))
+            ;
+    }
+    __atomic_fetch_sub(&q->consumers_waiting, 1, __ATOMIC_RELAXED);
+
+    /*
+     * Hand out the dummy with the string of its successor moved into it,
+     * the successor becoming the new dummy, so no node is allocated or
+     * freed under the lock.
+     */
+    size_t avail = __atomic_load_n(&q->count, __ATOMIC_ACQUIRE);
+    size_t cnt = 0;
+    while (cnt < n && cnt < avail) {
+        element_t *dummy = q->head, *next = next_of(dummy);
+        dummy->value = next->value;
+        next->value = NULL;
+        INIT_LIST_HEAD(&dummy->list);
+        out[cnt++] = dummy;
+        q->head = next;
+    }
+    size_t before = __atomic_fetch_sub(&q->count, cnt, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->head_lock);
+
+    /* One wakeup per take, and only if a producer may be stuck on a full q */
+    if (cnt && before >= q->capacity &&
+        __atomic_load_n(&q->producers_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->tail_lock);
+        pthread_cond_broadcast(&q->not_full);
+        pthread_mutex_unlock(&q->tail_lock);
+        __atomic_fetch_add(&q->wakeups, 1, __ATOMIC_RELAXED);
+    }
+    return cnt;
+}
+
+void bq_release_elements(element_t **out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        test_free(out[i]->value);
+        test_free(out[i]);
+    }
+}
+
+void bq_close(bq_t *q)
+{
+    __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&q->tail_lock);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->tail_lock);
+    pthread_mutex_lock(&q->head_lock);
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->head_lock);
+}
+
+size_t bq_size(bq_t *q)
+{
+    return __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+}
+
+size_t bq_wakeups(bq_t *q)
+{
+    return __atomic_load_n(&q->wakeups, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,71 @@
+#ifndef LAB0_BQ_H
+#define LAB0_BQ_H
+
+/*
+ * Blocking bounded queue of strings for producer/consumer pipelines.
+ *
+ * This is the two-lock queue: a singly linked list of element_t nodes behind
+ * a dummy node, with producers serialized on a tail lock and consumers on a
+ * separate head lock, so that the two sides never contend with each other.
+ * A full queue blocks producers and an empty one blocks consumers, both with
+ * a timeout.  Wakeups are coalesced: a consumer woken by the first string
+ * waits a little longer, at most BQ_LINGER_US in bq.c, for a whole batch
+ * and then takes what is there, and consumers signal sleeping producers
+ * once per take rather than once per string.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct bq bq_t;
+
+/*
+ * Create an empty queue holding at most capacity strings, whose woken
+ * consumers wait briefly for batch strings to be available (clamped to
+ * capacity; 1 does not wait).
+ * Return NULL if capacity or batch is 0, or could not allocate space.
+ */
+bq_t *bq_new(size_t capacity, size_t batch);
+
+/*
+ * Free all storage used by queue, including the strings still in it.
+ * No other thread may be using q.
+ */
+void bq_free(bq_t *q);
+
+/*
+ * Insert a copy of s at tail of queue, waiting up to timeout_us microseconds
+ * for room (forever if negative).
+ * Return false if s is NULL, the wait timed out, queue was closed, or could
+ * not allocate space.
+ */
+bool bq_insert_tail(bq_t *q, const char *s, long timeout_us);
+
+/*
+ * Remove up to n elements from head of queue into out, in queue order,
+ * waiting up to timeout_us microseconds (forever if negative) for the first
+ * one.  Like q_remove_head_n, the elements are not freed; release them with
+ * bq_release_elements.
+ * Return the number of elements removed, 0 on timeout or once queue is
+ * closed and drained.
+ */
+size_t bq_remove_head_n(bq_t *q, element_t **out, size_t n, long timeout_us);
+
+/* Release n elements removed by bq_remove_head_n */
+void bq_release_elements(element_t **out, size_t n);
+
+/*
+ * Refuse further insertions and wake every waiting thread.  Consumers may
+ * still drain what is left.
+ */
+void bq_close(bq_t *q);
+
+/* Return the number of strings in queue at the time of the call */
+size_t bq_size(bq_t *q);
+
+/* Return the number of wakeups sent to waiting producers and consumers */
+size_t bq_wakeups(bq_t *q);
+
+#endif /* LAB0_BQ_H */
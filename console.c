@@ -3,13 +3,18 @@
 #include "console.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -17,10 +22,24 @@
 
 #include "report.h"
 
+/* Most command lines have no more arguments than this */
+#define MAXARGS 32
+
+/* Initial number of slots in the command table, must be a power of 2 */
+#define CMD_MIN_SLOTS 64
+
 /* Some global values */
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
+
+/*
+ * Commands are also kept in an open-addressing hash table, indexed by name
+ * and at most half full, so that dispatching one does not walk cmd_list.
+ */
+static cmd_ptr *cmd_table = NULL;
+static size_t cmd_slots = 0;
+static size_t cmd_cnt = 0;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -34,6 +53,10 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ *
+ * Regular files are mapped into memory instead, and lines are handed to the
+ * interpreter where they lie in the mapping.  It is private and writable,
+ * so that lines can be split up in place.
  */
 
 #define RIO_BUFSIZE 8192
@@ -44,11 +67,17 @@ struct RIO_ELE {
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapping of a regular file, or NULL */
+    size_t map_len;        /* Length of the file */
+    size_t map_pos;        /* Offset of the next line */
     rio_ptr prev;          /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
-static char linebuf[RIO_BUFSIZE];
+
+/* Line read through a buffer, grown to fit the longest one */
+static char *linebuf = NULL;
+static size_t linebuf_size = 0;
 
 /* Maximum file descriptor */
 static int fd_max = 0;
@@ -59,6 +88,8 @@ static int err_cnt = 0;
 static int echo = 0;
 
 static bool quit_flag = false;
+/* Set by quit instead of quit_flag while a client's line is run */
+static bool *session_quit = NULL;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
 
@@ -68,6 +99,7 @@ static bool has_infile = false;
 #define MAXQUIT 10
 static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
+static cmd_hook_function cmd_hook = NULL;
 
 static void init_in();
 
@@ -76,6 +108,57 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* 32-bit FNV-1a */
+static uint32_t cmd_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void cmd_table_put(cmd_ptr *table, size_t slots, cmd_ptr cmd)
+{
+    size_t i = cmd_hash(cmd->name) & (slots - 1);
+    while (table[i])
+        i = (i + 1) & (slots - 1);
+    table[i] = cmd;
+}
+
+static void cmd_table_add(cmd_ptr cmd)
+{
+    if (2 * (cmd_cnt + 1) > cmd_slots) {
+        size_t slots = cmd_slots ? cmd_slots * 2 : CMD_MIN_SLOTS;
+        cmd_ptr *table =
+            calloc_or_fail(slots, sizeof(cmd_ptr), "cmd_table_add");
+        for (size_t i = 0; i < cmd_slots; i++) {
+            if (cmd_table[i])
+                cmd_table_put(table, slots, cmd_table[i]);
+        }
+        if (cmd_table)
+            free_array(cmd_table, cmd_slots, sizeof(cmd_ptr));
+        cmd_table = table;
+        cmd_slots = slots;
+    }
+    cmd_table_put(cmd_table, cmd_slots, cmd);
+    cmd_cnt++;
+}
+
+/* Find a command by name, NULL if there is none */
+static cmd_ptr find_cmd(const char *name)
+{
+    if (!cmd_slots)
+        return NULL;
+    for (size_t i = cmd_hash(name) & (cmd_slots - 1); cmd_table[i];
+         i = (i + 1) & (cmd_slots - 1)) {
+        if (!strcmp(cmd_table[i]->name, name))
+            return cmd_table[i];
+    }
+    return NULL;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -92,6 +175,7 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->documentation = documentation;
     ele->next = next_cmd;
     *last_loc = ele;
+    cmd_table_add(ele);
 }
 
 /* Add a new parameter */
@@ -116,50 +200,61 @@ void add_param(char *name,
     *last_loc = ele;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Count the white space separated arguments of a command line */
+static int count_args(const char *line)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
+    bool skipping = true;
+    for (const char *p = line; *p; p++) {
+        if (isspace((unsigned char) *p))
+            skipping = true;
+        else if (skipping) {
+            argc++;
+            skipping = false;
         }
     }
+    return argc;
+}
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+/*
+ * Split a command line into arguments in place, by replacing the white
+ * space after each one with a null character.  argv must have room for
+ * count_args(line) pointers.
+ */
+static void parse_args(char *line, char *argv[])
+{
+    int argc = 0;
+    char *p = line;
+    while (true) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (!*p)
+            break;
+        argv[argc++] = p;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+        if (!*p)
+            break;
+        *p++ = '\0';
     }
+}
 
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+/* Return buf, or a copy of it with room for at least need elements */
+static void *reserve_array(void *buf, size_t *size, size_t need, size_t elem)
+{
+    if (need <= *size)
+        return buf;
+
+    size_t n = *size ? *size : 64;
+    while (n < need)
+        n *= 2;
+    void *nbuf = malloc_or_fail(n * elem, "reserve_array");
+    if (buf) {
+        memcpy(nbuf, buf, *size * elem);
+        free_array(buf, *size, elem);
+    }
+    *size = n;
+    return nbuf;
 }
 
 static void record_error()
@@ -171,18 +266,18 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Execute a command found for argv[0], or report that there is none */
+static bool run_cmd(cmd_ptr next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        /* The command may be freed by quit, its name is a literal */
+        const char *name = next_cmd->name;
+        if (cmd_hook)
+            cmd_hook(name, false);
         ok = next_cmd->operation(argc, argv);
+        if (cmd_hook)
+            cmd_hook(name, true);
         if (!ok)
             record_error();
     } else {
@@ -194,7 +289,327 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+/*
+ * Repeat blocks
+ *
+ * "repeat N [var] {" starts a block that runs the commands up to the
+ * matching "}" N times, with $var, or $i by default, standing for the
+ * iteration, counted from 0.  Blocks nest, and inner ones can use the
+ * counters of outer ones.  Commands are split and looked up once, as the
+ * block is read, and then run from memory.
+ */
+
+typedef struct rep_block rep_block_t;
+
+/* Piece of an argument, either literal text or the counter of a block */
+typedef struct {
+    const char *text;
+    size_t len;
+    rep_block_t *var; /* Block whose counter this is, or NULL */
+} rep_part_t;
+
+typedef struct {
+    char *text;        /* Argument as read */
+    rep_part_t *parts; /* Pieces to expand it from, NULL without any $var */
+    int nparts;
+    char *buf; /* Expanded argument */
+    size_t buf_size;
+} rep_arg_t;
+
+typedef struct {
+    int argc;
+    rep_arg_t *args;
+    char **argv;        /* Arguments as passed to the command */
+    cmd_ptr cmd;        /* NULL when looked up as it runs */
+    rep_block_t *block; /* Nested block, instead of a command */
+} rep_item_t;
+
+struct rep_block {
+    long count;
+    long iter;
+    char *var;
+    rep_item_t *items;
+    size_t nitems, size;
+    rep_block_t *parent;
+};
+
+/* Innermost block being read, if any */
+static rep_block_t *rep_open = NULL;
+
+static bool is_var_char(char c)
+{
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+/* Parse "repeat N [var] {", reporting any problem */
+static bool rep_parse_head(int argc, char *argv[], long *count, char **var)
+{
+    *count = 0;
+    *var = "i";
+    if ((argc != 3 && argc != 4) || strcmp(argv[argc - 1], "{")) {
+        report(1, "Usage: repeat N [var] {");
+        return false;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    long n = strtol(argv[1], &end, 0);
+    if (errno || *end != '\0' || n < 0) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 4) {
+        for (const char *p = argv[2]; *p; p++) {
+            if (!is_var_char(*p)) {
+                report(1, "Invalid repeat variable '%s'", argv[2]);
+                return false;
+            }
+        }
+        *var = argv[2];
+    }
+    *count = n;
+    return true;
+}
+
+/* Open a block, which becomes the innermost one being read */
+static rep_block_t *rep_block_new(long count, char *var)
+{
+    rep_block_t *b = malloc_or_fail(sizeof(rep_block_t), "rep_block_new");
+    b->count = count;
+    b->iter = 0;
+    b->var = strsave_or_fail(var, "rep_block_new");
+    b->items = NULL;
+    b->nitems = b->size = 0;
+    b->parent = rep_open;
+    rep_open = b;
+    return b;
+}
+
+static rep_item_t *rep_item_new(rep_block_t *b)
+{
+    b->items = reserve_array(b->items, &b->size, b->nitems + 1,
+                             sizeof(rep_item_t));
+    rep_item_t *item = &b->items[b->nitems++];
+    memset(item, 0, sizeof(*item));
+    return item;
+}
+
+/* Find the counter named by the len characters at name */
+static rep_block_t *rep_find_var(const char *name, size_t len)
+{
+    for (rep_block_t *b = rep_open; b; b = b->parent) {
+        if (strlen(b->var) == len && !strncmp(b->var, name, len))
+            return b;
+    }
+    return NULL;
+}
+
+static void rep_add_part(rep_arg_t *a,
+                         size_t *size,
+                         const char *text,
+                         size_t len,
+                         rep_block_t *var)
+{
+    if (!len && !var)
+        return;
+    a->parts = reserve_array(a->parts, size, a->nparts + 1,
+                             sizeof(rep_part_t));
+    a->parts[a->nparts++] = (rep_part_t){text, len, var};
+    /* A counter never takes more than 20 characters */
+    a->buf_size += var ? 20 : len;
+}
+
+/* Save an argument, splitting it up around any counters it names */
+static void rep_arg_init(rep_arg_t *a, const char *text)
+{
+    a->text = strsave_or_fail((char *) text, "rep_arg_init");
+    a->parts = NULL;
+    a->nparts = 0;
+    a->buf = NULL;
+    a->buf_size = 1;
+
+    size_t size = 0;
+    const char *lit = a->text;
+    for (const char *p = a->text; (p = strchr(p, '$'));) {
+        const char *name = ++p;
+        while (is_var_char(*p))
+            p++;
+        rep_block_t *var = rep_find_var(name, p - name);
+        if (var) {
+            rep_add_part(a, &size, lit, name - 1 - lit, NULL);
+            rep_add_part(a, &size, NULL, 0, var);
+            lit = p;
+        }
+    }
+
+    if (!a->nparts)
+        return;
+    rep_add_part(a, &size, lit, strlen(lit), NULL);
+    /* Shrink the array to its length, so that it is easy to free */
+    rep_part_t *parts = malloc_or_fail(a->nparts * sizeof(rep_part_t),
+                                       "rep_arg_init");
+    memcpy(parts, a->parts, a->nparts * sizeof(rep_part_t));
+    free_array(a->parts, size, sizeof(rep_part_t));
+    a->parts = parts;
+    a->buf = malloc_or_fail(a->buf_size, "rep_arg_init");
+}
+
+/* Write n in decimal at p, returning the end of it */
+static char *put_long(char *p, long n)
+{
+    char digits[20];
+    int len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (len)
+        *p++ = digits[--len];
+    return p;
+}
+
+static void rep_expand(rep_arg_t *a)
+{
+    char *p = a->buf;
+    for (int i = 0; i < a->nparts; i++) {
+        rep_part_t *part = &a->parts[i];
+        if (part->var) {
+            p = put_long(p, part->var->iter);
+        } else {
+            memcpy(p, part->text, part->len);
+            p += part->len;
+        }
+    }
+    *p = '\0';
+}
+
+/* Add a command to the innermost block being read */
+static void rep_add_cmd(int argc, char *argv[])
+{
+    rep_item_t *item = rep_item_new(rep_open);
+    item->argc = argc;
+    item->args = malloc_or_fail(argc * sizeof(rep_arg_t), "rep_add_cmd");
+    item->argv = malloc_or_fail(argc * sizeof(char *), "rep_add_cmd");
+    for (int i = 0; i < argc; i++) {
+        rep_arg_init(&item->args[i], argv[i]);
+        item->argv[i] =
+            item->args[i].parts ? item->args[i].buf : item->args[i].text;
+    }
+    if (!item->args[0].parts)
+        item->cmd = find_cmd(argv[0]);
+}
+
+static void rep_free(rep_block_t *b)
+{
+    for (size_t i = 0; i < b->nitems; i++) {
+        rep_item_t *item = &b->items[i];
+        if (item->block) {
+            rep_free(item->block);
+            continue;
+        }
+        for (int j = 0; j < item->argc; j++) {
+            rep_arg_t *a = &item->args[j];
+            free_string(a->text);
+            if (a->parts) {
+                free_array(a->parts, a->nparts, sizeof(rep_part_t));
+                free_block(a->buf, a->buf_size);
+            }
+        }
+        free_array(item->args, item->argc, sizeof(rep_arg_t));
+        free_array(item->argv, item->argc, sizeof(char *));
+    }
+    if (b->items)
+        free_array(b->items, b->size, sizeof(rep_item_t));
+    free_string(b->var);
+    free_block(b, sizeof(rep_block_t));
+}
+
+/* Return whether quit has been run, for the program or for a client */
+static bool stopping()
+{
+    return quit_flag || (session_quit && *session_quit);
+}
+
+static void rep_run(rep_block_t *b)
+{
+    for (b->iter = 0; b->iter < b->count && !stopping(); b->iter++) {
+        for (size_t i = 0; i < b->nitems && !stopping(); i++) {
+            rep_item_t *item = &b->items[i];
+            if (item->block) {
+                rep_run(item->block);
+                continue;
+            }
+            for (int j = 0; j < item->argc; j++) {
+                if (item->args[j].parts)
+                    rep_expand(&item->args[j]);
+            }
+            cmd_ptr cmd = item->cmd ? item->cmd : find_cmd(item->argv[0]);
+            run_cmd(cmd, item->argc, item->argv);
+        }
+    }
+}
+
+/* Drop a block that was never closed, returning whether there was one */
+static bool rep_discard()
+{
+    if (!rep_open)
+        return false;
+
+    while (rep_open->parent)
+        rep_open = rep_open->parent;
+    rep_free(rep_open);
+    rep_open = NULL;
+    return true;
+}
+
+/*
+ * Take a command for the block being read, if there is one, and run the
+ * block once it is closed.  Return false if there is no block to take it.
+ */
+static bool rep_feed(int argc, char *argv[])
+{
+    if (!rep_open)
+        return false;
+    if (!argc)
+        return true;
+
+    if (!strcmp(argv[0], "}")) {
+        rep_block_t *b = rep_open;
+        rep_open = b->parent;
+        if (!rep_open) {
+            rep_run(b);
+            rep_free(b);
+        }
+        return true;
+    }
+
+    if (!strcmp(argv[0], "repeat") && !strcmp(argv[argc - 1], "{")) {
+        long count;
+        char *var;
+        if (!rep_parse_head(argc, argv, &count, &var))
+            record_error();
+        /* A malformed block is still read, but never run */
+        rep_item_t *item = rep_item_new(rep_open);
+        item->block = rep_block_new(count, var);
+        return true;
+    }
+
+    rep_add_cmd(argc, argv);
+    return true;
+}
+
+/*
+ * Execute a command from a command line, which gets split up in place.
+ * Unless it has more than MAXARGS arguments, nothing is allocated.
+ */
 static bool interpret_cmd(char *cmdline)
 {
     if (quit_flag)
@@ -203,12 +618,15 @@ static bool interpret_cmd(char *cmdline)
 #if RPT >= 6
     report(6, "Interpreting command '%s'\n", cmdline);
 #endif
-    int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char *local_argv[MAXARGS];
+    int argc = count_args(cmdline);
+    char **argv = argc <= MAXARGS ? local_argv
+                                  : malloc_or_fail(argc * sizeof(char *),
+                                                   "interpret_cmd");
+    parse_args(cmdline, argv);
+    bool ok = rep_feed(argc, argv) || interpret_cmda(argc, argv);
+    if (argv != local_argv)
+        free_array(argv, argc, sizeof(char *));
 
     return ok;
 }
@@ -222,6 +640,11 @@ void add_quit_helper(cmd_function qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+void set_cmd_hook(cmd_hook_function hook)
+{
+    cmd_hook = hook;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -231,6 +654,12 @@ void set_echo(bool on)
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
+    /* However it is reached, a client's quit only ends its own session */
+    if (session_quit) {
+        *session_quit = true;
+        return true;
+    }
+
     cmd_ptr c = cmd_list;
     bool ok = true;
     while (c) {
@@ -246,13 +675,28 @@ static bool do_quit(int argc, char *argv[])
         free_block(ele, sizeof(param_ele));
     }
 
+    if (cmd_table)
+        free_array(cmd_table, cmd_slots, sizeof(cmd_ptr));
+    cmd_table = NULL;
+    cmd_slots = cmd_cnt = 0;
+
     while (buf_stack)
         pop_file();
 
+    if (linebuf)
+        free_block(linebuf, linebuf_size);
+    linebuf = NULL;
+    linebuf_size = 0;
+
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    if (rep_discard()) {
+        report(1, "Missing '}' at end of repeat block");
+        ok = false;
+    }
+
     quit_flag = true;
     return ok;
 }
@@ -363,6 +807,17 @@ static bool do_source(int argc, char *argv[])
     return true;
 }
 
+static bool do_repeat(int argc, char *argv[])
+{
+    long count;
+    char *var;
+    bool ok = rep_parse_head(argc, argv, &count, &var);
+    /* A malformed block is still read up to its "}", but never run */
+    if (ok || !strcmp(argv[argc - 1], "{"))
+        rep_block_new(count, var);
+    return ok;
+}
+
 static bool do_log(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -402,6 +857,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    cmd_table = NULL;
+    cmd_slots = cmd_cnt = 0;
     err_cnt = 0;
     quit_flag = false;
 
@@ -410,6 +867,9 @@ void init_cmd()
     ADD_COMMAND(quit, "                | Exit program");
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
+    ADD_COMMAND(repeat,
+                " N [var] {      | Run commands up to } N times, with $var "
+                "(default $i) counting from 0");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
@@ -440,6 +900,31 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = rnew->map_pos = 0;
+
+    /*
+     * Anything mmap cannot take, such as a pipe, goes through the buffer.
+     * The file is mapped over anonymous memory one byte longer, so that
+     * even its last line is followed by a null character.
+     */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map != MAP_FAILED &&
+            mmap(map, st.st_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(map, st.st_size + 1);
+            map = MAP_FAILED;
+        }
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+        }
+    }
+
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -452,6 +937,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len + 1);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -463,19 +950,70 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/* Make room for a line of len bytes and a null character in linebuf */
+static void linebuf_reserve(size_t len)
+{
+    if (len < linebuf_size)
+        return;
+
+    size_t size = linebuf_size ? linebuf_size : RIO_BUFSIZE;
+    while (size <= len)
+        size *= 2;
+    char *buf = malloc_or_fail(size, "linebuf_reserve");
+    if (linebuf) {
+        memcpy(buf, linebuf, linebuf_size);
+        free_block(linebuf, linebuf_size);
+    }
+    linebuf = buf;
+    linebuf_size = size;
+}
+
+static void echo_line(const char *line)
+{
+    if (echo) {
+        report_noreturn(1, prompt);
+        report(1, "%s", line);
+    }
+}
+
+/* Return the next line of a mapped file, in place, or NULL at its end */
+static char *map_readline(rio_ptr rio)
+{
+    if (rio->map_pos >= rio->map_len)
+        return NULL;
+
+    char *line = rio->map + rio->map_pos;
+    size_t left = rio->map_len - rio->map_pos;
+    char *end = memchr(line, '\n', left);
+    if (end) {
+        *end = '\0';
+        rio->map_pos += end - line + 1;
+    } else {
+        /* The last line has no newline, but the mapping ends in a null */
+        rio->map_pos = rio->map_len;
+    }
+    return line;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
 static char *readline()
 {
-    int cnt;
-    char c;
-    char *lptr = linebuf;
-
     if (!buf_stack)
         return NULL;
 
-    for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    if (buf_stack->map) {
+        char *line = map_readline(buf_stack);
+        if (!line)
+            pop_file();
+        else
+            echo_line(line);
+        return line;
+    }
+
+    size_t cnt = 0;
+    while (true) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
             buf_stack->cnt = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
@@ -483,40 +1021,30 @@ static char *readline()
             if (buf_stack->cnt <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
+                if (!cnt)
+                    return NULL;
+                /* Last line of file did not terminate with newline. */
+                break;
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->cnt--;
-        if (c == '\n')
+        /* Copy up to the end of the line, or of the buffered text */
+        char *nl = memchr(buf_stack->bufptr, '\n', buf_stack->cnt);
+        size_t n = nl ? nl - buf_stack->bufptr : buf_stack->cnt;
+        linebuf_reserve(cnt + n);
+        memcpy(linebuf + cnt, buf_stack->bufptr, n);
+        cnt += n;
+        buf_stack->bufptr += n;
+        buf_stack->cnt -= n;
+        if (nl) {
+            buf_stack->bufptr++;
+            buf_stack->cnt--;
             break;
+        }
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
-    }
-    *lptr++ = '\0';
-
-    if (echo) {
-        report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
-    }
-
+    linebuf[cnt] = '\0';
+    echo_line(linebuf);
     return linebuf;
 }
 
@@ -547,6 +1075,18 @@ int cmd_select(int nfds,
     if (cmd_done())
         return 0;
 
+    /*
+     * With nothing else to wait for, a line that is already in memory can
+     * be run without asking select about it first.
+     */
+    if (!block_flag && !nfds && !readfds && has_infile &&
+        (buf_stack->map || buf_stack->cnt > 0)) {
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 1;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -586,6 +1126,223 @@ int cmd_select(int nfds,
     return result;
 }
 
+/*
+ * Pipelined replay
+ *
+ * A reader thread finds the lines of a mapped trace and splits them into
+ * arguments, handing them over through a single-producer, single-consumer
+ * ring, while the main thread runs them.  Only the main thread writes
+ * output or changes the file stack, and only it decides when to stop.
+ *
+ * The reader leaves lines as they are, so that they can be echoed before
+ * their arguments get terminated.  After a command that may change the
+ * file stack, or at the end of a file, it waits for the main thread to
+ * catch up, and then goes on with whatever file is on top.  Input that is
+ * not mapped is left to the main thread.
+ */
+
+/* Number of slots in the ring, must be a power of 2 */
+#define PIPE_SLOTS 256
+
+typedef enum {
+    PIPE_CMD,     /* Run a command */
+    PIPE_POP,     /* Close the file on top */
+    PIPE_HANDOFF, /* Read the rest without the reader */
+} pipe_kind_t;
+
+typedef struct {
+    pipe_kind_t kind;
+    char *line;
+    int argc; /* -1 when there are more than MAXARGS arguments */
+    char *argv[MAXARGS];
+    char *end[MAXARGS]; /* Where each argument is to be terminated */
+} pipe_slot_t;
+
+static bool pipeline = false;
+static pipe_slot_t *pipe_ring;
+static size_t pipe_head; /* Slots filled, only written by the reader */
+static size_t pipe_tail; /* Slots done, only written by the main thread */
+static bool pipe_stop;
+
+void set_pipeline_mode(bool on)
+{
+    pipeline = on;
+}
+
+/* Find the arguments of a line without changing it, -1 if too many */
+static int find_args(char *line, char *argv[], char *end[])
+{
+    int argc = 0;
+    char *p = line;
+    while (true) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (!*p)
+            break;
+        if (argc == MAXARGS)
+            return -1;
+        argv[argc] = p;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+        end[argc++] = p;
+    }
+    return argc;
+}
+
+static bool pipe_arg_is(const pipe_slot_t *s, int i, const char *word)
+{
+    size_t len = strlen(word);
+    return i < s->argc && s->end[i] - s->argv[i] == len &&
+           !memcmp(s->argv[i], word, len);
+}
+
+/*
+ * Whether the reader must wait for a command to run before reading on,
+ * since it may open or close files.  That is source or quit, on its own or
+ * as the argument of time ("time source F", "time quit", but not a bare
+ * time), or the "}" that runs a repeat block.  A line with more than
+ * MAXARGS arguments is not split here, so it is waited on too.
+ */
+static bool pipe_barrier(const pipe_slot_t *s)
+{
+    int i = pipe_arg_is(s, 0, "time") ? 1 : 0;
+    return s->argc < 0 || pipe_arg_is(s, 0, "}") ||
+           pipe_arg_is(s, i, "source") || pipe_arg_is(s, i, "quit");
+}
+
+/* Wait until the main thread has done n slots, false if it gave up */
+static bool pipe_wait_tail(size_t n)
+{
+    while (__atomic_load_n(&pipe_tail, __ATOMIC_ACQUIRE) < n) {
+        if (__atomic_load_n(&pipe_stop, __ATOMIC_ACQUIRE))
+            return false;
+        sched_yield();
+    }
+    return true;
+}
+
+static void *pipe_reader(void *arg)
+{
+    for (size_t head = 0;; head++) {
+        if (head >= PIPE_SLOTS && !pipe_wait_tail(head + 1 - PIPE_SLOTS))
+            break;
+
+        pipe_slot_t *s = &pipe_ring[head & (PIPE_SLOTS - 1)];
+        char *line = NULL;
+        if (!buf_stack || !buf_stack->map)
+            s->kind = PIPE_HANDOFF;
+        else if (!(line = map_readline(buf_stack)))
+            s->kind = PIPE_POP;
+        else {
+            s->kind = PIPE_CMD;
+            s->line = line;
+            s->argc = find_args(line, s->argv, s->end);
+        }
+        bool barrier = s->kind != PIPE_CMD || pipe_barrier(s);
+        __atomic_store_n(&pipe_head, head + 1, __ATOMIC_RELEASE);
+
+        if (s->kind == PIPE_HANDOFF || (barrier && !pipe_wait_tail(head + 1)))
+            break;
+    }
+    return NULL;
+}
+
+static void pipe_run(pipe_slot_t *s)
+{
+    echo_line(s->line);
+    if (s->argc < 0) {
+        interpret_cmd(s->line);
+        return;
+    }
+    if (quit_flag)
+        return;
+    for (int i = 0; i < s->argc; i++)
+        *s->end[i] = '\0';
+    if (!rep_feed(s->argc, s->argv))
+        interpret_cmda(s->argc, s->argv);
+}
+
+/*
+ * Run commands from the mapped file on top of the stack, and from files it
+ * sources, until they run out, the input is no longer mapped, or quit_flag
+ * is set.  Return false if the reader could not be started.
+ */
+static bool run_pipelined()
+{
+    pipe_ring = malloc_or_fail(PIPE_SLOTS * sizeof(pipe_slot_t),
+                               "run_pipelined");
+    pipe_head = pipe_tail = 0;
+    pipe_stop = false;
+
+    /* Signals, such as the alarm for time budgets, are for this thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_t reader;
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    bool started = !pthread_create(&reader, NULL, pipe_reader, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for (size_t tail = 0; started && !quit_flag; tail++) {
+        while (__atomic_load_n(&pipe_head, __ATOMIC_ACQUIRE) == tail)
+            sched_yield();
+
+        pipe_slot_t *s = &pipe_ring[tail & (PIPE_SLOTS - 1)];
+        if (s->kind == PIPE_HANDOFF)
+            break;
+        if (s->kind == PIPE_POP)
+            pop_file();
+        else
+            pipe_run(s);
+        __atomic_store_n(&pipe_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    if (started) {
+        __atomic_store_n(&pipe_stop, true, __ATOMIC_RELEASE);
+        pthread_join(reader, NULL);
+    }
+    free_array(pipe_ring, PIPE_SLOTS, sizeof(pipe_slot_t));
+    return started;
+}
+
+bool interpret_line(char *line, bool *quit)
+{
+    int cnt = err_cnt;
+    int limit = err_limit;
+    rio_ptr base = buf_stack;
+    bool infile = has_infile;
+    err_limit = INT_MAX;
+    *quit = false;
+    session_quit = quit;
+    bool ok = interpret_cmd(line);
+
+    /* Run any file the line sourced before answering */
+    while (buf_stack != base && !stopping()) {
+        char *cmdline = readline();
+        if (cmdline)
+            ok = interpret_cmd(cmdline) && ok;
+    }
+    while (buf_stack != base)
+        pop_file();
+    has_infile = infile;
+
+    session_quit = NULL;
+    err_cnt = cnt;
+    /* Unless the line itself set a new limit */
+    if (err_limit == INT_MAX)
+        err_limit = limit;
+    return ok;
+}
+
+bool block_pending()
+{
+    return rep_open != NULL;
+}
+
+void discard_block()
+{
+    rep_discard();
+}
+
 bool finish_cmd()
 {
     bool ok = true;
@@ -636,8 +1393,363 @@ void completion(const char *buf, linenoiseCompletions *lc)
     }
 }
 
+/*
+ * Compiled traces
+ *
+ * A trace can be compiled ahead of time into bytecode, so that replaying it
+ * neither reads nor splits lines.  The file holds, in host byte order:
+ *
+ *     qbc_header_t
+ *     uint32_t offset[nstrs]    Start of each string in the pool
+ *     char pool[pool_len]       Distinct strings, null-terminated and padded
+ *                               to a multiple of 4 bytes
+ *     uint32_t code[code_len]   Instructions
+ *
+ * An instruction is a word holding argc, followed by the indices of its
+ * arguments in the string table.  When echoing the arguments joined by
+ * single spaces would not reproduce the line, QBC_RAW is set and the index
+ * of the line itself follows.
+ */
+
+#define QBC_MAGIC "QBC1"
+#define QBC_RAW 0x80000000u
+
+typedef struct {
+    char magic[4];
+    uint32_t nstrs;
+    uint32_t pool_len;
+    uint32_t code_len;
+} qbc_header_t;
+
+typedef struct {
+    char *pool;
+    size_t pool_len, pool_size;
+    uint32_t *offset;
+    size_t nstrs, offset_size;
+    uint32_t *slots; /* String index plus one, or 0 when empty */
+    size_t nslots;
+    uint32_t *code;
+    size_t code_len, code_size;
+} qbc_builder_t;
+
+static void qbc_emit(qbc_builder_t *b, uint32_t word)
+{
+    b->code = reserve_array(b->code, &b->code_size, b->code_len + 1,
+                          sizeof(uint32_t));
+    b->code[b->code_len++] = word;
+}
+
+/* Return the index of s in the string table, adding it on first use */
+static uint32_t qbc_intern(qbc_builder_t *b, const char *s)
+{
+    if (2 * (b->nstrs + 1) > b->nslots) {
+        size_t n = b->nslots ? b->nslots * 2 : CMD_MIN_SLOTS;
+        uint32_t *slots = calloc_or_fail(n, sizeof(uint32_t), "qbc_intern");
+        for (size_t i = 0; i < b->nstrs; i++) {
+            size_t j = cmd_hash(b->pool + b->offset[i]) & (n - 1);
+            while (slots[j])
+                j = (j + 1) & (n - 1);
+            slots[j] = i + 1;
+        }
+        if (b->slots)
+            free_array(b->slots, b->nslots, sizeof(uint32_t));
+        b->slots = slots;
+        b->nslots = n;
+    }
+
+    size_t j = cmd_hash(s) & (b->nslots - 1);
+    for (; b->slots[j]; j = (j + 1) & (b->nslots - 1)) {
+        uint32_t i = b->slots[j] - 1;
+        if (!strcmp(b->pool + b->offset[i], s))
+            return i;
+    }
+
+    size_t len = strlen(s) + 1;
+    b->pool = reserve_array(b->pool, &b->pool_size, b->pool_len + len, 1);
+    memcpy(b->pool + b->pool_len, s, len);
+    b->offset = reserve_array(b->offset, &b->offset_size, b->nstrs + 1,
+                            sizeof(uint32_t));
+    b->offset[b->nstrs] = b->pool_len;
+    b->pool_len += len;
+    b->slots[j] = ++b->nstrs;
+    return b->nstrs - 1;
+}
+
+static void qbc_free(qbc_builder_t *b)
+{
+    if (b->pool)
+        free_array(b->pool, b->pool_size, 1);
+    if (b->offset)
+        free_array(b->offset, b->offset_size, sizeof(uint32_t));
+    if (b->slots)
+        free_array(b->slots, b->nslots, sizeof(uint32_t));
+    if (b->code)
+        free_array(b->code, b->code_size, sizeof(uint32_t));
+}
+
+/* Whether a line reads the same as its arguments joined by single spaces */
+static bool is_canonical(const char *line)
+{
+    char prev = ' ';
+    for (const char *p = line; *p; p++) {
+        if (isspace((unsigned char) *p) && (*p != ' ' || prev == ' '))
+            return false;
+        prev = *p;
+    }
+    return !*line || prev != ' ';
+}
+
+/* Compile one line, which gets split up in place */
+static void qbc_compile_line(qbc_builder_t *b,
+                             char *line,
+                             const char *in_name,
+                             int lineno)
+{
+    bool raw = !is_canonical(line);
+    uint32_t raw_index = raw ? qbc_intern(b, line) : 0;
+
+    int argc = count_args(line);
+    char *local_argv[MAXARGS];
+    char **argv = argc <= MAXARGS ? local_argv
+                                  : malloc_or_fail(argc * sizeof(char *),
+                                                   "qbc_compile_line");
+    parse_args(line, argv);
+    if (argc && strcmp(argv[0], "}") && !find_cmd(argv[0]))
+        report(1, "%s:%d: Unknown command '%s'", in_name, lineno, argv[0]);
+
+    qbc_emit(b, argc | (raw ? QBC_RAW : 0));
+    for (int i = 0; i < argc; i++)
+        qbc_emit(b, qbc_intern(b, argv[i]));
+    if (raw)
+        qbc_emit(b, raw_index);
+
+    if (argv != local_argv)
+        free_array(argv, argc, sizeof(char *));
+}
+
+static bool qbc_write(qbc_builder_t *b, const char *out_name)
+{
+    FILE *f = fopen(out_name, "wb");
+    if (!f) {
+        report(1, "Could not open output file '%s'", out_name);
+        return false;
+    }
+
+    /* Keep the code aligned for the reader */
+    size_t pad = -b->pool_len & 3;
+    b->pool = reserve_array(b->pool, &b->pool_size, b->pool_len + pad, 1);
+    memset(b->pool + b->pool_len, 0, pad);
+
+    qbc_header_t h;
+    memcpy(h.magic, QBC_MAGIC, sizeof(h.magic));
+    h.nstrs = b->nstrs;
+    h.pool_len = b->pool_len + pad;
+    h.code_len = b->code_len;
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(b->offset, sizeof(uint32_t), b->nstrs, f) == b->nstrs &&
+              fwrite(b->pool, 1, h.pool_len, f) == h.pool_len &&
+              fwrite(b->code, sizeof(uint32_t), b->code_len, f) ==
+                  b->code_len;
+    ok = !fclose(f) && ok;
+    if (!ok)
+        report(1, "Could not write output file '%s'", out_name);
+    return ok;
+}
+
+bool compile_file(char *in_name, char *out_name)
+{
+    int fd = open(in_name, O_RDONLY);
+    if (fd < 0) {
+        report(1, "Could not open source file '%s'", in_name);
+        return false;
+    }
+
+    /* Read the whole trace, leaving room to terminate its last line */
+    char *text = NULL;
+    size_t len = 0, size = 0;
+    ssize_t n;
+    do {
+        text = reserve_array(text, &size, len + RIO_BUFSIZE + 1, 1);
+        n = read(fd, text + len, size - len - 1);
+        if (n > 0)
+            len += n;
+    } while (n > 0);
+    close(fd);
+    if (n < 0) {
+        report(1, "Could not read source file '%s'", in_name);
+        free_array(text, size, 1);
+        return false;
+    }
+    text[len] = '\0';
+
+    qbc_builder_t b;
+    memset(&b, 0, sizeof(b));
+    int lineno = 0;
+    for (char *line = text; line < text + len;) {
+        char *end = memchr(line, '\n', text + len - line);
+        if (!end)
+            end = text + len;
+        *end = '\0';
+        qbc_compile_line(&b, line, in_name, ++lineno);
+        line = end + 1;
+    }
+    free_array(text, size, 1);
+
+    bool ok = qbc_write(&b, out_name);
+    if (ok)
+        report(1, "Compiled %d lines into %zu words, with %zu strings",
+               lineno, b.code_len, b.nstrs);
+    qbc_free(&b);
+    return ok;
+}
+
+/* Check that a compiled trace is well formed before running any of it */
+static bool qbc_check(size_t len,
+                      const qbc_header_t *h,
+                      const uint32_t *offset,
+                      const char *pool,
+                      const uint32_t *code)
+{
+    size_t need = sizeof(*h) + ((size_t) h->nstrs + h->code_len) * 4;
+    if (h->pool_len % 4 || len < need || len - need != h->pool_len)
+        return false;
+    /* The padding, or else the last string, ends the pool */
+    if (h->nstrs && (!h->pool_len || pool[h->pool_len - 1]))
+        return false;
+    for (size_t i = 0; i < h->nstrs; i++) {
+        if (offset[i] >= h->pool_len)
+            return false;
+    }
+
+    for (size_t pc = 0; pc < h->code_len;) {
+        uint32_t argc = code[pc] & ~QBC_RAW;
+        size_t words = 1 + argc + !!(code[pc] & QBC_RAW);
+        if (words > h->code_len - pc)
+            return false;
+        for (size_t i = 1; i < words; i++) {
+            if (code[pc + i] >= h->nstrs)
+                return false;
+        }
+        pc += words;
+    }
+    return true;
+}
+
+/* Echo an instruction the way its line would have been echoed */
+static void qbc_echo(int argc, char *argv[], const char *raw)
+{
+    if (!raw) {
+        size_t len = 0;
+        for (int i = 0; i < argc; i++)
+            len += strlen(argv[i]) + 1;
+        linebuf_reserve(len);
+        char *p = linebuf;
+        for (int i = 0; i < argc; i++) {
+            if (i)
+                *p++ = ' ';
+            size_t n = strlen(argv[i]);
+            memcpy(p, argv[i], n);
+            p += n;
+        }
+        *p = '\0';
+        raw = linebuf;
+    }
+    echo_line(raw);
+}
+
+/*
+ * Run a compiled trace.  Commands are looked up once for each distinct
+ * name.  Arguments point into the string table and are shared between
+ * instructions, which is why it is mapped read-only.
+ */
+static bool run_compiled(int fd, char *fname)
+{
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= (off_t) sizeof(qbc_header_t))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        report(1, "ERROR: Could not read compiled trace '%s'", fname);
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const qbc_header_t *h = (const qbc_header_t *) map;
+    const uint32_t *offset = (const uint32_t *) (h + 1);
+    char *pool = (char *) (offset + h->nstrs);
+    const uint32_t *code = (const uint32_t *) (pool + h->pool_len);
+    if (memcmp(h->magic, QBC_MAGIC, sizeof(h->magic)) ||
+        !qbc_check(st.st_size, h, offset, pool, code)) {
+        report(1, "ERROR: Malformed compiled trace '%s'", fname);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    size_t nstrs = h->nstrs;
+    char **strs = NULL;
+    cmd_ptr *cmds = NULL;
+    if (nstrs) {
+        strs = malloc_or_fail(nstrs * sizeof(char *), "run_compiled");
+        cmds = calloc_or_fail(nstrs, sizeof(cmd_ptr), "run_compiled");
+        for (size_t i = 0; i < nstrs; i++)
+            strs[i] = pool + offset[i];
+    }
+
+    char *local_argv[MAXARGS];
+    for (size_t pc = 0; pc < h->code_len && !quit_flag;) {
+        int argc = code[pc] & ~QBC_RAW;
+        bool raw = code[pc++] & QBC_RAW;
+        char **argv = argc <= MAXARGS ? local_argv
+                                      : malloc_or_fail(argc * sizeof(char *),
+                                                       "run_compiled");
+        for (int i = 0; i < argc; i++)
+            argv[i] = strs[code[pc + i]];
+
+        if (echo)
+            qbc_echo(argc, argv, raw ? strs[code[pc + argc]] : NULL);
+        if (!rep_feed(argc, argv) && argc) {
+            uint32_t name = code[pc];
+            if (!cmds[name])
+                cmds[name] = find_cmd(argv[0]);
+            run_cmd(cmds[name], argc, argv);
+        }
+        pc += argc + raw;
+
+        if (argv != local_argv)
+            free_array(argv, argc, sizeof(char *));
+
+        /* Let a sourced file run before going on */
+        while (!cmd_done())
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+
+    if (nstrs) {
+        free_array(strs, nstrs, sizeof(char *));
+        free_array(cmds, nstrs, sizeof(cmd_ptr));
+    }
+    munmap(map, st.st_size);
+    return err_cnt == 0;
+}
+
 bool run_console(char *infile_name)
 {
+    /*
+     * A compiled trace is told apart from text by its magic number.  Only
+     * regular files are looked at, since what is read from a pipe is gone.
+     */
+    if (infile_name) {
+        int fd = open(infile_name, O_RDONLY);
+        struct stat st;
+        char magic[sizeof(QBC_MAGIC) - 1];
+        if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+            pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+            !memcmp(magic, QBC_MAGIC, sizeof(magic)))
+            return run_compiled(fd, infile_name);
+        if (fd >= 0)
+            close(fd);
+    }
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -646,15 +1758,19 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while ((cmdline = linenoise(prompt)) != NULL) {
-            interpret_cmd(cmdline);
+            /* Before the line gets split up */
             linenoiseHistoryAdd(cmdline);       /* Add to the history. */
+            interpret_cmd(cmdline);
             linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
             linenoiseFree(cmdline);
         }
     } else {
+        if (pipeline && buf_stack->map)
+            run_pipelined();
         while (!cmd_done())
             cmd_select(0, NULL, NULL, NULL, NULL);
     }
 
     return err_cnt == 0;
 }
+
@@ -57,9 +57,31 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf);
 
+/* Optionally supply function invoked before and after every command */
+typedef void (*cmd_hook_function)(const char *name, bool done);
+void set_cmd_hook(cmd_hook_function hook);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/*
+ * Turn pipelined replay on/off.  When on, lines of a trace file are read
+ * and split by another thread while the commands before them run.
+ */
+void set_pipeline_mode(bool on);
+
+/*
+ * Run one command line, which gets split up in place, on behalf of a
+ * client that is told the outcome, along with any file it sources.
+ * Errors are not counted against the error limit, and quit, however it is
+ * reached, only sets *quit, since one client should not stop the others.
+ */
+bool interpret_line(char *line, bool *quit);
+
+/* Return whether a repeat block is being read, and drop any such block */
+bool block_pending();
+void discard_block();
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
@@ -75,10 +97,18 @@ int cmd_select(int nfds,
                fd_set *exceptfds,
                struct timeval *timeout);
 
-/* Run command loop.  Non-null infile_name implies read commands from that file
+/* Run command loop.  Non-null infile_name implies read commands from that file,
+ * which, if it is a regular file, may also have been compiled with compile_file
  */
 bool run_console(char *infile_name);
 
+/*
+ * Compile the commands in in_name into bytecode, written to out_name, that
+ * run_console replays with the same results as the text.  Commands must
+ * have been added already, so that unknown ones can be warned about.
+ */
+bool compile_file(char *in_name, char *out_name);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
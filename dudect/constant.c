@@ -12,6 +12,9 @@
 
 #define N_MEASURE 150
 
+/* Number of elements taken by each measured q_remove_head_n call */
+#define REMOVE_BATCH 16
+
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
 
@@ -33,6 +36,7 @@ enum {
     test_insert_tail,
     test_remove_head,
     test_remove_tail,
+    test_remove_head_n,
 };
 
 /* Implement the necessary queue interface to simulation */
@@ -69,7 +73,8 @@ void measure(int64_t *before_ticks,
              int mode)
 {
     assert(mode == test_insert_head || mode == test_insert_tail ||
-           mode == test_remove_head || mode == test_remove_tail);
+           mode == test_remove_head || mode == test_remove_tail ||
+           mode == test_remove_head_n);
 
     switch (mode) {
     case test_insert_head:
@@ -126,6 +131,22 @@ void measure(int64_t *before_ticks,
             dut_free();
         }
         break;
+    case test_remove_head_n:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            element_t *out[REMOVE_BATCH];
+            dut_new();
+            /* Always leave a full batch so only the queue length varies */
+            dut_insert_head(get_random_string(), REMOVE_BATCH);
+            dut_insert_head(
+                get_random_string(),
+                *(uint16_t *) (input_data + i * chunk_size) % 10000);
+            before_ticks[i] = cpucycles();
+            size_t cnt = q_remove_head_n(l, out, REMOVE_BATCH);
+            after_ticks[i] = cpucycles();
+            q_release_elements(out, cnt);
+            dut_free();
+        }
+        break;
     default:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             dut_new();
@@ -190,3 +190,8 @@ bool is_remove_tail_const(void)
 {
     return TEST_CONST("remove_tail", 3);
 }
+
+bool is_remove_head_n_const(void)
+{
+    return TEST_CONST("remove_head_n", 4);
+}
@@ -9,5 +9,6 @@ bool is_insert_head_const(void);
 bool is_insert_tail_const(void);
 bool is_remove_head_const(void);
 bool is_remove_tail_const(void);
+bool is_remove_head_n_const(void);
 
 #endif
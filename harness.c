@@ -1,10 +1,16 @@
 /* Test support code */
 
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -27,32 +33,119 @@
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
-/* Data structures used by our code */
+/* Initial number of slots in the live block set, must be a power of 2 */
+#define LIVE_MIN_SLOTS 64
 
 /*
- * Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+ * Guard mode limits.  Each guarded block costs two kernel mappings, so only
+ * this many are guarded at a time and later blocks come from malloc, which
+ * keeps well below the default vm.max_map_count of 65530.
  */
+#define GUARD_MAX_LIVE 16384
+
+/* Number of freed guarded blocks kept inaccessible before being unmapped */
+#define GUARD_QUARANTINE 1024
+
+/* Data structures used by our code */
+
+struct arena;
+
+/* Header placed in front of every allocated block */
 typedef struct BELE {
-    struct BELE *next, *prev;
+    struct arena *arena; /* Arena the block is live in */
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    bool poisoned;       /* Whether the payload gets filled with FILLCHAR */
+    bool guarded;        /* Whether the payload ends at a PROT_NONE page */
+    unsigned char payload[0] __attribute__((aligned(16)));
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
-static size_t allocated_count = 0;
+/*
+ * Allocated blocks are kept in one set per thread, so that worker threads
+ * can allocate and free without contending with each other.  Each set has
+ * its own lock, only ever contended when a block is freed by another thread
+ * than the one which allocated it.  Arenas are never freed: the one of an
+ * exited thread keeps its blocks and is handed over to the next new thread.
+ *
+ * The set is an open-addressing hash table of block addresses with linear
+ * probing, kept at most half full, so that cautious mode can tell whether a
+ * block is live in constant time however many blocks are allocated.
+ */
+typedef struct arena {
+    struct arena *next; /* All arenas */
+    int lock;           /* Spinlock protecting live and its count */
+    bool active;        /* Whether a live thread owns the arena */
+    block_ele_t **live; /* Live blocks, NULL marks an empty slot */
+    size_t live_mask;   /* Number of slots minus one */
+    size_t allocated_count;
+    /* Profile of the blocks allocated from this arena */
+    size_t allocs, frees, bytes;
+    size_t live_bytes, peak_bytes;
+    size_t hist[ALLOC_HIST_BUCKETS];
+} arena_t;
+
+static arena_t *arenas = NULL;
+static __thread arena_t *thread_arena = NULL;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/*
+ * Fault scheduler.  Random failures draw from a seeded xorshift generator,
+ * one per thread, restarted from fault_rng_seed whenever it is reseeded so
+ * that runs are reproducible.  fault_armed is set while a countdown or a
+ * per-operation schedule is pending, so that with no failures requested an
+ * allocation only tests two integers.
+ */
+static uint64_t fault_rng_seed = 1;
+static unsigned int fault_epoch = 1;
+static __thread uint64_t fault_rng;
+static __thread unsigned int fault_rng_epoch = 0;
+static bool fault_armed = false;
+static size_t fault_countdown = 0;
+static uint64_t fault_mask = 0;
+static size_t fault_op_allocs = 0;
+static size_t fault_injected = 0;
+
+/* How thoroughly blocks are checked, and how often sampled ones are */
+int check_level = CHECK_FULL;
+int check_sample = 16;
+static __thread unsigned int sample_tick = 0;
+
 static bool cautious_mode = true;
+static bool guard_mode = false;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Time budget of each timed operation in microseconds, 0 for none */
+int time_budget = 1000000;
+static bool budget_mode = true;
+
+/* Budget of the running operation, and time used by past ones */
+static long budget_armed = 0;
+static long budget_last = 0;
+static long budget_peak = 0;
+
+/*
+ * Batch mode.  Instead of saving the signal mask and arming the timer for
+ * every operation, which takes three system calls, the mask is saved once
+ * and a periodic timer ticks for as long as the mode lasts.  Operations
+ * only note when they start, through the vDSO clock, and each tick checks
+ * whether the running one went over its budget.  A tick comes every
+ * quarter of the budget, but at most every BATCH_MIN_TICK microseconds,
+ * so an operation is stopped within 1.25 times its budget, or its budget
+ * plus BATCH_MIN_TICK for small ones.
+ */
+#define BATCH_MIN_TICK 1000
+
+static bool batch_mode = false;
+static sigset_t batch_mask;
+static long batch_tick_budget = 0; /* Budget the ticks were set up for */
+static struct timespec op_start;
 
 /*
  * Data for managing exceptions
@@ -65,11 +158,276 @@ static bool time_limited = false;
  * Internal functions
  */
 
+static inline void arena_lock(arena_t *a)
+{
+    while (__atomic_exchange_n(&a->lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&a->lock, __ATOMIC_RELAXED))
+            sched_yield();
+    }
+}
+
+static inline void arena_unlock(arena_t *a)
+{
+    __atomic_store_n(&a->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Home slot of a block, by Fibonacci hashing of its address */
+static inline size_t live_slot(const arena_t *a, const block_ele_t *b)
+{
+    uint64_t h = ((uintptr_t) b >> 4) * 0x9E3779B97F4A7C15ull;
+    return (h ^ (h >> 32)) & a->live_mask;
+}
+
+/* Double the number of slots, return false if could not allocate them */
+static bool live_grow(arena_t *a)
+{
+    size_t n = a->live ? (a->live_mask + 1) << 1 : LIVE_MIN_SLOTS;
+    block_ele_t **old = a->live;
+    size_t oldn = old ? a->live_mask + 1 : 0;
+    block_ele_t **nl = calloc(n, sizeof(block_ele_t *));
+    if (!nl)
+        return false;
+
+    a->live = nl;
+    a->live_mask = n - 1;
+    for (size_t i = 0; i < oldn; i++) {
+        if (!old[i])
+            continue;
+        size_t j = live_slot(a, old[i]);
+        while (nl[j])
+            j = (j + 1) & a->live_mask;
+        nl[j] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* Add a block to the set, return false if could not allocate space */
+static bool live_add(arena_t *a, block_ele_t *b)
+{
+    if (2 * (a->allocated_count + 1) > (a->live ? a->live_mask + 1 : 0) &&
+        !live_grow(a))
+        return false;
+
+    size_t i = live_slot(a, b);
+    while (a->live[i])
+        i = (i + 1) & a->live_mask;
+    a->live[i] = b;
+    a->allocated_count++;
+    return true;
+}
+
+static bool live_has(const arena_t *a, const block_ele_t *b)
+{
+    if (!a->live)
+        return false;
+    for (size_t i = live_slot(a, b); a->live[i]; i = (i + 1) & a->live_mask) {
+        if (a->live[i] == b)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Remove a block from the set, if present.  Later entries of the probe run
+ * are shifted back into the hole, so that no tombstones are needed.
+ */
+static void live_del(arena_t *a, const block_ele_t *b)
+{
+    if (!a->live)
+        return;
+
+    size_t i = live_slot(a, b);
+    while (a->live[i] != b) {
+        if (!a->live[i])
+            return;
+        i = (i + 1) & a->live_mask;
+    }
+
+    for (size_t j = (i + 1) & a->live_mask; a->live[j];
+         j = (j + 1) & a->live_mask) {
+        /* An entry may fill the hole unless its home lies within (i, j] */
+        size_t k = live_slot(a, a->live[j]);
+        if (i < j ? (k <= i || k > j) : (k <= i && k > j)) {
+            a->live[i] = a->live[j];
+            i = j;
+        }
+    }
+    a->live[i] = NULL;
+    a->allocated_count--;
+}
+
+/* Hand the arena of an exiting thread over to the next new thread */
+static void arena_release(void *arg)
+{
+    arena_t *a = arg;
+    __atomic_store_n(&a->active, false, __ATOMIC_RELEASE);
+}
+
+static void arena_key_init()
+{
+    pthread_key_create(&arena_key, arena_release);
+}
+
+/* Return the arena of the calling thread, NULL if could not allocate one */
+static arena_t *get_arena()
+{
+    if (thread_arena)
+        return thread_arena;
+    pthread_once(&arena_once, arena_key_init);
+
+    arena_t *a;
+    for (a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); a; a = a->next) {
+        bool idle = false;
+        if (__atomic_compare_exchange_n(&a->active, &idle, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!a) {
+        a = calloc(1, sizeof(arena_t));
+        if (!a)
+            return NULL;
+        a->active = true;
+        a->next = __atomic_load_n(&arenas, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&arenas, &a->next, a, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    thread_arena = a;
+    pthread_setspecific(arena_key, a);
+    return a;
+}
+
+/*
+ * Guarded blocks.  The payload is placed so that it ends exactly where an
+ * inaccessible page starts, and the header sits right in front of it, so
+ * any access past the end faults at once.  Freed blocks have their pages
+ * protected as well and wait in a quarantine ring before being unmapped, so
+ * that touching them faults too.
+ */
+typedef struct {
+    void *base;
+    size_t len;
+} guard_map_t;
+
+static size_t page_size = 0;
+static size_t guard_live = 0;
+static guard_map_t quarantine[GUARD_QUARANTINE];
+static size_t quarantine_next = 0;
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Header of the block holding payload p, guarded or not */
+static inline block_ele_t *block_of(void *p)
+{
+    return (block_ele_t *) (((uintptr_t) p - sizeof(block_ele_t)) &
+                            ~(uintptr_t) 15);
+}
+
+/* Mapping holding a guarded payload of the given size, guard page included */
+static guard_map_t guard_span(void *p, size_t size)
+{
+    uintptr_t guard = ((uintptr_t) p + size + page_size - 1) & ~(page_size - 1);
+    size_t data = (size + sizeof(block_ele_t) + 32 + page_size - 1) &
+                  ~(page_size - 1);
+    return (guard_map_t){(void *) (guard - data), data + page_size};
+}
+
+/*
+ * Map a guarded block and return its payload.  The payload keeps the largest
+ * power of two alignment dividing its size, up to 16, so that it can end
+ * right at the guard page.  Return NULL once GUARD_MAX_LIVE blocks are
+ * guarded or if the mapping failed, in which case malloc should be used.
+ */
+static void *guard_alloc(size_t size)
+{
+    if (__atomic_add_fetch(&guard_live, 1, __ATOMIC_RELAXED) > GUARD_MAX_LIVE)
+        goto fail;
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    size_t data = (size + sizeof(block_ele_t) + 32 + page_size - 1) &
+                  ~(page_size - 1);
+    char *base = mmap(NULL, data + page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        goto fail;
+    if (mprotect(base + data, page_size, PROT_NONE)) {
+        munmap(base, data + page_size);
+        goto fail;
+    }
+
+    size_t align = size & -size;
+    if (!align || align > 16)
+        align = 16;
+    return (void *) ((uintptr_t) (base + data - size) & ~(align - 1));
+
+fail:
+    __atomic_sub_fetch(&guard_live, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Protect a freed guarded block and unmap the oldest one in quarantine */
+static void guard_release(void *p, size_t size)
+{
+    guard_map_t m = guard_span(p, size);
+    mprotect(m.base, m.len - page_size, PROT_NONE);
+
+    pthread_mutex_lock(&quarantine_lock);
+    guard_map_t old = quarantine[quarantine_next];
+    quarantine[quarantine_next] = m;
+    quarantine_next = (quarantine_next + 1) % GUARD_QUARANTINE;
+    pthread_mutex_unlock(&quarantine_lock);
+
+    if (old.base)
+        munmap(old.base, old.len);
+    __atomic_sub_fetch(&guard_live, 1, __ATOMIC_RELAXED);
+}
+
+/* xorshift64*, returning the high 32 bits */
+static uint32_t fault_random()
+{
+    if (fault_rng_epoch != __atomic_load_n(&fault_epoch, __ATOMIC_RELAXED)) {
+        fault_rng_epoch = __atomic_load_n(&fault_epoch, __ATOMIC_RELAXED);
+        /* A zero state would stay zero */
+        fault_rng = fault_rng_seed ? fault_rng_seed : 0x9E3779B97F4A7C15ull;
+    }
+    fault_rng ^= fault_rng >> 12;
+    fault_rng ^= fault_rng << 25;
+    fault_rng ^= fault_rng >> 27;
+    return (fault_rng * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static bool fault_scheduled()
+{
+    bool fail = false;
+    if (fault_countdown &&
+        !__atomic_sub_fetch(&fault_countdown, 1, __ATOMIC_RELAXED))
+        fail = true;
+
+    size_t i = __atomic_fetch_add(&fault_op_allocs, 1, __ATOMIC_RELAXED);
+    if (i < 64 && (fault_mask >> i) & 1)
+        fail = true;
+
+    fault_armed = fault_countdown || fault_mask;
+    return fail;
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static inline bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (__builtin_expect(!fault_armed && !fail_probability, 1))
+        return false;
+
+    bool fail = fault_armed && fault_scheduled();
+    /* Scale a 32-bit draw to [0, 100) without dividing */
+    if (fail_probability && ((uint64_t) fault_random() * 100 >> 32) <
+                                (uint64_t) fail_probability)
+        fail = true;
+    if (fail)
+        __atomic_add_fetch(&fault_injected, 1, __ATOMIC_RELAXED);
+    return fail;
 }
 
 /*
@@ -83,20 +441,23 @@ static block_ele_t *find_header(void *p)
         error_occurred = true;
     }
 
-    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    block_ele_t *b = block_of(p);
     if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
+        /* Make sure this is really an allocated block, by any thread */
         bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
+        for (arena_t *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE);
+             a && !found; a = a->next) {
+            arena_lock(a);
+            found = live_has(a, b);
+            arena_unlock(a);
         }
         if (!found) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
+            /* Do not touch it, it may be a quarantined guarded block */
+            return NULL;
         }
     }
 
@@ -111,6 +472,16 @@ static block_ele_t *find_header(void *p)
     return b;
 }
 
+/* Should the payload of a new block be poisoned at the current level? */
+static inline bool poison_block()
+{
+    if (check_level >= CHECK_FULL)
+        return true;
+    if (check_level != CHECK_SAMPLED)
+        return false;
+    return check_sample <= 1 || ++sample_tick % check_sample == 0;
+}
+
 /* Given pointer to block, find its footer */
 static size_t *find_footer(block_ele_t *b)
 {
@@ -134,8 +505,14 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+    arena_t *a = get_arena();
+    void *p = a && guard_mode ? guard_alloc(size) : NULL;
+    bool guarded = p != NULL;
+    block_ele_t *new_block = guarded ? block_of(p) : NULL;
+    if (!guarded && a) {
+        new_block = malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+        p = new_block ? (void *) &new_block->payload : NULL;
+    }
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
@@ -145,19 +522,36 @@ void *test_malloc(size_t size)
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
+    /* Overflowing a guarded block faults instead of hitting a footer */
+    new_block->guarded = guarded;
+    if (!guarded)
+        *find_footer(new_block) = MAGICFOOTER;
+    new_block->poisoned = poison_block();
+    if (new_block->poisoned)
+        memset(p, FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
-
+    new_block->arena = a;
+
+    arena_lock(a);
+    bool ok = live_add(a, new_block);
+    if (ok) {
+        a->allocs++;
+        a->bytes += size;
+        a->live_bytes += size;
+        if (a->live_bytes > a->peak_bytes)
+            a->peak_bytes = a->live_bytes;
+        a->hist[size ? 64 - __builtin_clzl(size) : 0]++;
+    }
+    arena_unlock(a);
+    if (!ok) {
+        if (guarded)
+            guard_release(p, size);
+        else
+            free(new_block);
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
     return p;
 }
 
@@ -184,8 +578,9 @@ void test_free(void *p)
         return;
 
     block_ele_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
+    if (!b)
+        return;
+    if (!b->guarded && *find_footer(b) != MAGICFOOTER) {
         report_event(MSG_ERROR,
                      "Corruption detected in block with address %p when "
                      "attempting to free it",
@@ -193,21 +588,23 @@ void test_free(void *p)
         error_occurred = true;
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_ele_t *bn = b->next;
-    block_ele_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
+    if (!b->guarded)
+        *find_footer(b) = MAGICFREE;
+    if (b->poisoned)
+        memset(p, FILLCHAR, b->payload_size);
+
+    /* Drop from its set, which may belong to another thread */
+    arena_t *a = b->arena;
+    arena_lock(a);
+    live_del(a, b);
+    a->frees++;
+    a->live_bytes -= b->payload_size;
+    arena_unlock(a);
+
+    if (b->guarded)
+        guard_release(p, b->payload_size);
     else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
-    free(b);
-    allocated_count--;
+        free(b);
 }
 
 // cppcheck-suppress unusedFunction
@@ -223,7 +620,31 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t cnt = 0;
+    for (arena_t *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); a;
+         a = a->next) {
+        arena_lock(a);
+        cnt += a->allocated_count;
+        arena_unlock(a);
+    }
+    return cnt;
+}
+
+void alloc_stats(alloc_stat_t *st)
+{
+    memset(st, 0, sizeof(*st));
+    for (arena_t *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); a;
+         a = a->next) {
+        arena_lock(a);
+        st->allocs += a->allocs;
+        st->frees += a->frees;
+        st->bytes += a->bytes;
+        st->live_bytes += a->live_bytes;
+        st->peak_bytes += a->peak_bytes;
+        for (int i = 0; i < ALLOC_HIST_BUCKETS; i++)
+            st->hist[i] += a->hist[i];
+        arena_unlock(a);
+    }
 }
 
 /*
@@ -239,6 +660,71 @@ void set_cautious_mode(bool cautious)
     cautious_mode = cautious;
 }
 
+/*
+ * Fault injection controls
+ */
+void fault_seed(uint64_t seed)
+{
+    fault_rng_seed = seed;
+    __atomic_add_fetch(&fault_epoch, 1, __ATOMIC_RELAXED);
+}
+
+void fault_fail_nth(size_t n)
+{
+    fault_countdown = n;
+    fault_armed = fault_countdown || fault_mask;
+}
+
+void fault_set_schedule(uint64_t mask)
+{
+    fault_mask = mask;
+    fault_armed = fault_countdown || fault_mask;
+}
+
+bool fault_active()
+{
+    return fault_armed || fail_probability;
+}
+
+void fault_status(fault_stat_t *st)
+{
+    st->seed = fault_rng_seed;
+    st->countdown = fault_countdown;
+    st->schedule = fault_mask;
+    st->injected = __atomic_load_n(&fault_injected, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set/unset time budgets.
+ * Without them, timed operations may run as long as they need, which
+ * suits slow tools such as valgrind or a debugger.
+ */
+void set_budget_mode(bool enforce)
+{
+    budget_mode = enforce;
+}
+
+void budget_stats(long *last_us, long *peak_us)
+{
+    *last_us = budget_last;
+    *peak_us = budget_peak;
+}
+
+void budget_reset()
+{
+    budget_last = budget_peak = 0;
+}
+
+/*
+ * Set/unset guard mode.
+ * In this mode, blocks end at an inaccessible page and stay inaccessible for
+ * a while once freed, so that overruns and uses after free fault at once.
+ */
+void set_guard_mode(bool guard)
+{
+    guard_mode = guard;
+}
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
@@ -258,18 +744,106 @@ bool error_check()
     return e;
 }
 
+static long op_elapsed()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - op_start.tv_sec) * 1000000L +
+           (now.tv_nsec - op_start.tv_nsec) / 1000;
+}
+
+static void budget_record(long used)
+{
+    budget_last = used;
+    if (budget_last > budget_peak)
+        budget_peak = budget_last;
+}
+
+/* Set the periodic timer of batch mode going, or stop it with 0 */
+static void batch_tick(long budget)
+{
+    long tick = budget / 4 > BATCH_MIN_TICK ? budget / 4 : BATCH_MIN_TICK;
+    struct itimerval it = {0};
+    if (budget) {
+        it.it_value = it.it_interval =
+            (struct timeval){tick / 1000000, tick % 1000000};
+    }
+    setitimer(ITIMER_REAL, &it, NULL);
+    batch_tick_budget = budget;
+}
+
+/* Start timing an operation in batch mode, without any system call */
+static void batch_start()
+{
+    if (batch_tick_budget != time_budget)
+        batch_tick(time_budget);
+    budget_armed = time_budget;
+    clock_gettime(CLOCK_MONOTONIC, &op_start);
+    time_limited = true;
+}
+
+static void batch_stop()
+{
+    time_limited = false;
+    budget_record(op_elapsed());
+}
+
+/* Start counting down the budget, SIGALRM is raised once it runs out */
+static void budget_arm()
+{
+    budget_armed = time_budget;
+    struct itimerval it = {
+        .it_value = {budget_armed / 1000000, budget_armed % 1000000},
+    };
+    setitimer(ITIMER_REAL, &it, NULL);
+    time_limited = true;
+}
+
+/* Stop the timer and record how much of the budget was used */
+static void budget_disarm()
+{
+    struct itimerval it = {0}, left;
+    setitimer(ITIMER_REAL, &it, &left);
+    time_limited = false;
+
+    budget_record(budget_armed -
+                  (left.it_value.tv_sec * 1000000L + left.it_value.tv_usec));
+}
+
+void set_batch_mode(bool batch)
+{
+    if (batch == batch_mode)
+        return;
+    if (batch)
+        sigprocmask(SIG_BLOCK, NULL, &batch_mask);
+    else if (batch_tick_budget)
+        batch_tick(0);
+    batch_mode = batch;
+}
+
+bool budget_expired()
+{
+    if (!batch_mode)
+        return true;
+    return time_limited && op_elapsed() >= budget_armed;
+}
+
 /*
  * Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time)
 {
-    if (sigsetjmp(env, 1)) {
+    /* Batch mode saved the mask once, and restores it only on errors */
+    if (sigsetjmp(env, !batch_mode)) {
         /* Got here from longjmp */
         jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
+        if (batch_mode) {
+            sigprocmask(SIG_SETMASK, &batch_mask, NULL);
+            if (time_limited)
+                batch_stop();
+        } else if (time_limited) {
+            budget_disarm();
         }
 
         if (error_message)
@@ -279,10 +853,13 @@ bool exception_setup(bool limit_time)
     }
 
     /* Got here from initial call */
+    fault_op_allocs = 0;
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
-        time_limited = true;
+    if (limit_time && budget_mode && time_budget > 0) {
+        if (batch_mode)
+            batch_start();
+        else
+            budget_arm();
     }
     return true;
 }
@@ -293,8 +870,10 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
-        time_limited = false;
+        if (batch_mode)
+            batch_stop();
+        else
+            budget_disarm();
     }
 
     jmp_ready = false;
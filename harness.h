@@ -4,6 +4,7 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * This test harness enables us to do stringent testing of code.
@@ -17,20 +18,129 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/*
+ * Support code such as mpmc.c defines INTERNAL before including this, so
+ * that malloc and free stay libc's.  Whatever a queue hands back to qtest,
+ * nodes and strings, should still come from test_malloc, so that leaks and
+ * corruption get caught; libc memory is for what outlives any one test or
+ * needs an alignment the harness does not give.
+ */
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/*
+ * Allocation profile.  Bucket 0 of the histogram counts empty blocks, and
+ * bucket i > 0 counts blocks of 2^(i-1) to 2^i - 1 bytes.  Peaks are kept
+ * per thread, so peak_bytes is exact while one thread allocates and an
+ * upper bound otherwise.
+ */
+#define ALLOC_HIST_BUCKETS 65
+
+typedef struct {
+    size_t allocs, frees;
+    size_t bytes;      /* Payload bytes of all allocations */
+    size_t live_bytes; /* Payload bytes of allocated blocks */
+    size_t peak_bytes; /* Largest live_bytes seen, summed over threads */
+    size_t hist[ALLOC_HIST_BUCKETS];
+} alloc_stat_t;
+
+void alloc_stats(alloc_stat_t *st);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Fault injection.  On top of failing at random with fail_probability,
+ * allocations can be made to fail on a schedule.  An operation runs from
+ * one exception_setup to the next.  Everything is deterministic for a
+ * given seed, and costs next to nothing while no failure is requested.
+ */
+
+/* Restart the generator behind fail_probability from the given seed */
+void fault_seed(uint64_t seed);
+
+/* Fail the nth allocation from now, once; 0 cancels */
+void fault_fail_nth(size_t n);
+
+/* Fail allocation i + 1 of every operation for each bit i set in mask */
+void fault_set_schedule(uint64_t mask);
+
+typedef struct {
+    uint64_t seed;
+    size_t countdown; /* Allocations left before the nth one fails, or 0 */
+    uint64_t schedule;
+    size_t injected; /* Failures injected so far, of any kind */
+} fault_stat_t;
+
+void fault_status(fault_stat_t *st);
+
+/* Return whether any allocation failure, random or scheduled, is requested */
+bool fault_active();
+
+/*
+ * Checking levels.  Every level verifies the header and footer markers of
+ * a block when it is freed.  CHECK_FULL also fills every payload with a
+ * known byte when allocated and again when freed, which catches reads of
+ * uninitialized and freed memory but costs two passes over each block.
+ * CHECK_SAMPLED does so for one block in check_sample only.
+ */
+#define CHECK_CANARY 0
+#define CHECK_SAMPLED 1
+#define CHECK_FULL 2
+
+extern int check_level;
+extern int check_sample;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
 void set_cautious_mode(bool cautious);
 
+/*
+ * Time budget of each operation run with exception_setup(true), in
+ * microseconds.  Running out of it raises SIGALRM, whose handler should
+ * call trigger_exception.  0 leaves operations untimed.
+ */
+extern int time_budget;
+
+/*
+ * Set/unset time budgets.
+ * Without them, timed operations may run as long as they need, which
+ * suits slow tools such as valgrind or a debugger.
+ */
+void set_budget_mode(bool enforce);
+
+/*
+ * Set/unset batch mode.
+ * In this mode, timed operations make no system calls: a periodic timer
+ * runs for the whole batch and SIGALRM only means that the budget may have
+ * run out, which the handler should confirm with budget_expired.  A budget
+ * is enforced within a quarter of itself, or a millisecond if more.
+ * Enter and leave the mode between operations.
+ */
+void set_batch_mode(bool batch);
+
+/* Whether SIGALRM found the running operation over its budget */
+bool budget_expired();
+
+/*
+ * Microseconds of its budget used by the last timed operation, and the
+ * most used by any since budget_reset.  Operations which ran out count
+ * as having used their whole budget.
+ */
+void budget_stats(long *last_us, long *peak_us);
+void budget_reset();
+
+/*
+ * Set/unset guard mode.
+ * In this mode, blocks end at an inaccessible page and stay inaccessible for
+ * a while once freed, so that overruns and uses after free fault at once.
+ */
+void set_guard_mode(bool guard);
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
@@ -0,0 +1,164 @@
+/* Hash-consed, reference-counted string pool */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "intern.h"
+
+/* Initial number of hash buckets, must be a power of 2 */
+#define INTERN_MIN_BUCKETS 256
+
+typedef struct intern_ent {
+    struct intern_ent *next; /* Next entry in the same bucket */
+    uint32_t hash;
+    uint32_t refcnt;
+    size_t len; /* Length of str, excluding the null terminator */
+    char str[];
+} intern_ent_t;
+
+static intern_ent_t **buckets = NULL;
+static size_t nbuckets = 0;
+static size_t nstrings = 0;
+
+/* Statistics, updated as references come and go */
+static size_t nrefs = 0;
+static size_t str_bytes = 0;
+static size_t plain_bytes = 0;
+
+/* 32-bit FNV-1a */
+uint32_t intern_hash(const char *s, size_t *lenp)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    uint32_t h = 2166136261u;
+    while (*p) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    *lenp = (const char *) p - s;
+    return h;
+}
+
+static inline intern_ent_t *to_ent(char *p)
+{
+    return (intern_ent_t *) (p - offsetof(intern_ent_t, str));
+}
+
+/* Double the table once the load factor exceeds one */
+static bool intern_grow()
+{
+    size_t n = nbuckets ? nbuckets << 1 : INTERN_MIN_BUCKETS;
+    intern_ent_t **nb = malloc(n * sizeof(intern_ent_t *));
+    if (!nb)
+        return false;
+    memset(nb, 0, n * sizeof(intern_ent_t *));
+
+    for (size_t i = 0; i < nbuckets; i++) {
+        intern_ent_t *e = buckets[i];
+        while (e) {
+            intern_ent_t *next = e->next;
+            size_t slot = e->hash & (n - 1);
+            e->next = nb[slot];
+            nb[slot] = e;
+            e = next;
+        }
+    }
+
+    free(buckets);
+    buckets = nb;
+    nbuckets = n;
+    return true;
+}
+
+char *intern_get(const char *s)
+{
+    size_t len;
+    uint32_t h = intern_hash(s, &len);
+
+    if (nbuckets) {
+        for (intern_ent_t *e = buckets[h & (nbuckets - 1)]; e; e = e->next) {
+            if (e->hash == h && e->len == len && !memcmp(e->str, s, len)) {
+                e->refcnt++;
+                nrefs++;
+                plain_bytes += len + 1;
+                return e->str;
+            }
+        }
+    }
+
+    if (nstrings >= nbuckets && !intern_grow() && !nbuckets)
+        return NULL;
+
+    intern_ent_t *e = malloc(sizeof(intern_ent_t) + len + 1);
+    if (!e) {
+        /* Do not keep an empty table around */
+        if (!nstrings) {
+            free(buckets);
+            buckets = NULL;
+            nbuckets = 0;
+        }
+        return NULL;
+    }
+    e->hash = h;
+    e->refcnt = 1;
+    e->len = len;
+    memcpy(e->str, s, len + 1);
+
+    size_t slot = h & (nbuckets - 1);
+    e->next = buckets[slot];
+    buckets[slot] = e;
+
+    nstrings++;
+    nrefs++;
+    str_bytes += len + 1;
+    plain_bytes += len + 1;
+    return e->str;
+}
+
+char *intern_dup(char *p)
+{
+    intern_ent_t *e = to_ent(p);
+    e->refcnt++;
+    nrefs++;
+    plain_bytes += e->len + 1;
+    return p;
+}
+
+bool intern_put(char *p)
+{
+    if (!p)
+        return false;
+
+    /* The entry is found from p, and its bucket from the hash kept in it */
+    intern_ent_t *e = to_ent(p);
+    nrefs--;
+    plain_bytes -= e->len + 1;
+    if (--e->refcnt)
+        return true;
+
+    intern_ent_t **pp = &buckets[e->hash & (nbuckets - 1)];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    str_bytes -= e->len + 1;
+    free(e);
+    nstrings--;
+
+    /* Hand the table back as well, so that an empty pool owns no blocks */
+    if (!nstrings) {
+        free(buckets);
+        buckets = NULL;
+        nbuckets = 0;
+    }
+    return true;
+}
+
+void intern_stats(intern_stat_t *st)
+{
+    st->strings = nstrings;
+    st->refs = nrefs;
+    st->pool_bytes = nstrings * sizeof(intern_ent_t) + str_bytes +
+                     nbuckets * sizeof(intern_ent_t *);
+    st->plain_bytes = plain_bytes;
+}
@@ -0,0 +1,55 @@
+#ifndef LAB0_INTERN_H
+#define LAB0_INTERN_H
+
+/*
+ * String interning pool.
+ *
+ * Equal strings are hash-consed into a single immutable, reference-counted
+ * copy, so duplicate-heavy workloads pay for one allocation per distinct
+ * string and two interned strings are equal iff their pointers are equal.
+ * Storage comes from the test harness allocator, and the pool gives back
+ * every block it holds once the last reference is dropped.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hash a string with 32-bit FNV-1a and store its length at *lenp.
+ * The pool uses it internally, and other string-keyed tables may share it.
+ */
+uint32_t intern_hash(const char *s, size_t *lenp);
+
+/*
+ * Return the interned copy of s, creating it on first use.
+ * Every successful call takes a reference that must be dropped with
+ * intern_put.  Return NULL if could not allocate space.
+ */
+char *intern_get(const char *s);
+
+/*
+ * Take one more reference to p, which must have been returned by intern_get.
+ * This is cheaper than intern_get since no lookup is needed.
+ */
+char *intern_dup(char *p);
+
+/*
+ * Drop one reference to p, which must have been returned by intern_get, and
+ * release it once unused.  The string is not looked up, so callers have to
+ * keep track of which of their strings are interned.
+ * Return false if p is NULL.
+ */
+bool intern_put(char *p);
+
+/* Pool statistics */
+typedef struct {
+    size_t strings;     /* Distinct strings held by the pool */
+    size_t refs;        /* References handed out */
+    size_t pool_bytes;  /* Bytes used by the pool, including its table */
+    size_t plain_bytes; /* Bytes one private copy per reference would use */
+} intern_stat_t;
+
+void intern_stats(intern_stat_t *st);
+
+#endif /* LAB0_INTERN_H */
@@ -428,6 +428,189 @@ static inline void list_move_tail(struct list_head *node,
          &entry->member != (head); entry = safe,                           \
         safe = list_entry(safe->member.next, __typeof__(*entry), member))
 
+/**
+ * struct hlist_head - Head of a singly-linked hash chain
+ * @first: pointer to the first node of the chain, NULL if the chain is empty
+ *
+ * Hash tables keep an array of these heads, one per bucket. The head only
+ * holds one pointer, so it takes half the space of a struct list_head, which
+ * adds up for tables with many buckets.
+ */
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+/**
+ * struct hlist_node - Node of a hash chain
+ * @next: pointer to the next node in the chain, NULL at the end of the chain
+ * @pprev: pointer to the previous node's @next (or the head's @first)
+ *
+ * Pointing at the previous link instead of the previous node allows a node to
+ * be removed in O(1) without knowing the head of the chain it is on.
+ */
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+/**
+ * INIT_HLIST_HEAD() - Initialize empty hash chain head
+ * @head: pointer to the hash chain head
+ */
+static inline void INIT_HLIST_HEAD(struct hlist_head *head)
+{
+    head->first = NULL;
+}
+
+/**
+ * INIT_HLIST_NODE() - Initialize an unhashed hash chain node
+ * @node: pointer to the node
+ *
+ * An initialized node can be passed to hlist_unhashed and hlist_del_init
+ * without being on any chain.
+ */
+static inline void INIT_HLIST_NODE(struct hlist_node *node)
+{
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+/**
+ * hlist_unhashed() - Check if node is not on any hash chain
+ * @node: pointer to the initialized node
+ *
+ * Return: 0 - node is on a chain !0 - node is not on a chain
+ */
+static inline int hlist_unhashed(const struct hlist_node *node)
+{
+    return !node->pprev;
+}
+
+/**
+ * hlist_empty() - Check if hash chain has no nodes attached
+ * @head: pointer to the hash chain head
+ *
+ * Return: 0 - chain is not empty !0 - chain is empty
+ */
+static inline int hlist_empty(const struct hlist_head *head)
+{
+    return !head->first;
+}
+
+/**
+ * hlist_add_head() - Add a node to the beginning of the hash chain
+ * @node: pointer to the new node
+ * @head: pointer to the hash chain head
+ */
+static inline void hlist_add_head(struct hlist_node *node,
+                                  struct hlist_head *head)
+{
+    struct hlist_node *first = head->first;
+
+    node->next = first;
+    if (first)
+        first->pprev = &node->next;
+    head->first = node;
+    node->pprev = &head->first;
+}
+
+/**
+ * hlist_del() - Remove a node from its hash chain
+ * @node: pointer to the node
+ *
+ * As with list_del, the node has to be handled like an uninitialized node
+ * afterwards.
+ */
+static inline void hlist_del(struct hlist_node *node)
+{
+    struct hlist_node *next = node->next;
+    struct hlist_node **pprev = node->pprev;
+
+    *pprev = next;
+    if (next)
+        next->pprev = pprev;
+}
+
+/**
+ * hlist_del_init() - Remove a node from its hash chain and reinitialize it
+ * @node: pointer to the initialized node
+ *
+ * Unlike hlist_del, calling this on a node which is not on any chain is safe
+ * and has no effect.
+ */
+static inline void hlist_del_init(struct hlist_node *node)
+{
+    if (hlist_unhashed(node))
+        return;
+    hlist_del(node);
+    INIT_HLIST_NODE(node);
+}
+
+/**
+ * hlist_entry() - Calculate address of entry that contains hash chain node
+ * @node: pointer to hash chain node
+ * @type: type of the entry containing the node
+ * @member: name of the hlist_node member variable in struct @type
+ *
+ * Return: @type pointer of entry containing node
+ */
+#define hlist_entry(node, type, member) container_of(node, type, member)
+
+/**
+ * hlist_entry_safe() - Calculate address of entry, allowing a NULL node
+ * @node: pointer to hash chain node, may be NULL
+ * @type: type of the entry containing the node
+ * @member: name of the hlist_node member variable in struct @type
+ *
+ * Return: @type pointer of entry containing node, NULL if @node is NULL
+ */
+#ifdef __LIST_HAVE_TYPEOF
+#define hlist_entry_safe(node, type, member)                 \
+    __extension__({                                          \
+        struct hlist_node *__hnode = (node);                 \
+        __hnode ? hlist_entry(__hnode, type, member) : NULL; \
+    })
+#endif
+
+/**
+ * hlist_for_each - iterate over hash chain nodes
+ * @node: hlist_node pointer used as iterator
+ * @head: pointer to the hash chain head
+ *
+ * The chain must be kept unmodified while iterating through it.
+ */
+#define hlist_for_each(node, head) \
+    for (node = (head)->first; node; node = node->next)
+
+/**
+ * hlist_for_each_safe - iterate over hash chain nodes and allow deletes
+ * @node: hlist_node pointer used as iterator
+ * @safe: hlist_node pointer used to store info for next node in chain
+ * @head: pointer to the hash chain head
+ *
+ * The current node (iterator) is allowed to be removed from the chain.
+ */
+#define hlist_for_each_safe(node, safe, head)                    \
+    for (node = (head)->first; node && ((safe = node->next), 1); \
+         node = safe)
+
+/**
+ * hlist_for_each_entry - iterate over hash chain entries
+ * @entry: pointer used as iterator, NULL once the iteration completes
+ * @head: pointer to the hash chain head
+ * @member: name of the hlist_node member variable in struct type of @entry
+ *
+ * The chain must be kept unmodified while iterating through it.
+ *
+ * FIXME: remove dependency of __typeof__ extension
+ */
+#ifdef __LIST_HAVE_TYPEOF
+#define hlist_for_each_entry(entry, head, member)                    \
+    for (entry = hlist_entry_safe((head)->first, __typeof__(*entry), \
+                                  member);                           \
+         entry; entry = hlist_entry_safe(entry->member.next,         \
+                                         __typeof__(*entry), member))
+#endif
+
 #undef __LIST_HAVE_TYPEOF
 
 #ifdef __cplusplus
@@ -0,0 +1,102 @@
+/* Least-recently-used cache on top of an indexed queue */
+
+#include <stdlib.h>
+
+#include "harness.h"
+#include "lru.h"
+
+struct lru {
+    struct list_head *q; /* Recency order, most recently used first */
+    size_t capacity;
+    size_t size;
+    lru_stat_t st;
+};
+
+lru_t *lru_new(size_t capacity)
+{
+    if (!capacity)
+        return NULL;
+
+    lru_t *c = malloc(sizeof(lru_t));
+    if (!c)
+        return NULL;
+    c->q = q_new();
+    if (!c->q || !q_index_enable(c->q, true)) {
+        q_free(c->q);
+        free(c);
+        return NULL;
+    }
+    c->capacity = capacity;
+    c->size = 0;
+    c->st.hits = c->st.misses = c->st.evictions = 0;
+    return c;
+}
+
+void lru_free(lru_t *c)
+{
+    if (!c)
+        return;
+    q_free(c->q);
+    free(c);
+}
+
+element_t *lru_get(lru_t *c, const char *key)
+{
+    if (!c)
+        return NULL;
+
+    element_t *e = q_find(c->q, key);
+    if (!e) {
+        c->st.misses++;
+        return NULL;
+    }
+    c->st.hits++;
+    list_move(&e->list, c->q);
+    return e;
+}
+
+element_t *lru_put(lru_t *c, const char *key)
+{
+    element_t *e = lru_get(c, key);
+    if (e || !c)
+        return e;
+
+    if (c->size == c->capacity)
+        lru_evict(c);
+    if (!q_insert_head(c->q, (char *) key))
+        return NULL;
+    c->size++;
+    return list_first_entry(c->q, element_t, list);
+}
+
+bool lru_evict(lru_t *c)
+{
+    if (!c || !c->size)
+        return false;
+
+    element_t *e = q_remove_tail(c->q, NULL, 0);
+    if (!e)
+        return false;
+    q_release_element(e);
+    c->size--;
+    c->st.evictions++;
+    return true;
+}
+
+size_t lru_size(lru_t *c)
+{
+    return c ? c->size : 0;
+}
+
+struct list_head *lru_list(lru_t *c)
+{
+    return c ? c->q : NULL;
+}
+
+void lru_stats(lru_t *c, lru_stat_t *st)
+{
+    if (c)
+        *st = c->st;
+    else
+        st->hits = st->misses = st->evictions = 0;
+}
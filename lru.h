@@ -0,0 +1,64 @@
+#ifndef LAB0_LRU_H
+#define LAB0_LRU_H
+
+/*
+ * Least-recently-used cache of strings.
+ *
+ * The cache is a queue kept in recency order, most recently used first,
+ * together with the queue's hash index for lookups.  A hit moves the element
+ * to the head with list_move, and the element at the tail is the one evicted
+ * once the cache is full.  All operations take O(1) expected time.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct lru lru_t;
+
+/* Cache statistics, counted since the cache was created */
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} lru_stat_t;
+
+/*
+ * Create an empty cache holding at most capacity strings.
+ * Return NULL if capacity is 0 or could not allocate space.
+ */
+lru_t *lru_new(size_t capacity);
+
+/* Free all storage used by cache.  No effect if c is NULL. */
+void lru_free(lru_t *c);
+
+/*
+ * Look up key and mark it as most recently used.
+ * Return the element holding key, or NULL on a miss.
+ */
+element_t *lru_get(lru_t *c, const char *key);
+
+/*
+ * Look up key and insert it on a miss, evicting the least recently used
+ * string first if the cache is full.  Either way key ends up most recently
+ * used.
+ * Return the element holding key, or NULL if could not allocate space.
+ */
+element_t *lru_put(lru_t *c, const char *key);
+
+/*
+ * Drop the least recently used string.
+ * Return false if c is NULL or empty.
+ */
+bool lru_evict(lru_t *c);
+
+/* Return the number of strings held by cache */
+size_t lru_size(lru_t *c);
+
+/* Return the recency queue of cache, most recently used first */
+struct list_head *lru_list(lru_t *c);
+
+void lru_stats(lru_t *c, lru_stat_t *st);
+
+#endif /* LAB0_LRU_H */
@@ -0,0 +1,320 @@
+/* Michael-Scott lock-free queue with hazard pointer reclamation */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpmc.h"
+
+/* The queue header and hazard pointer records outlive any one test */
+#define INTERNAL 1
+#include "harness.h"
+
+#define CACHE_LINE 64
+
+/* Hazard pointers per thread: the head and its successor */
+#define HP_PER_THREAD 2
+
+/* Retired nodes a thread accumulates before scanning the hazard pointers */
+#define HP_SCAN_MIN 64
+
+/* Hazard pointer record, one per thread, recycled once the thread exits */
+typedef struct hp_rec {
+    struct hp_rec *next; /* Records are never freed, only recycled */
+    int active;
+    element_t *hp[HP_PER_THREAD];
+    element_t **retired;
+    size_t nretired, cap;
+} hp_rec_t;
+
+struct mpmc {
+    element_t *head __attribute__((aligned(CACHE_LINE)));
+    element_t *tail __attribute__((aligned(CACHE_LINE)));
+};
+
+static hp_rec_t *hp_list = NULL;
+static size_t hp_count = 0;
+
+static __thread hp_rec_t *hp_self = NULL;
+static pthread_key_t hp_key;
+static pthread_once_t hp_once = PTHREAD_ONCE_INIT;
+
+/* The link to the next node lives in list.next, the rest of list is unused */
+static inline element_t *next_of(element_t *e)
+{
+    struct list_head *l = __atomic_load_n(&e->list.next, __ATOMIC_ACQUIRE);
+    return l ? list_entry(l, element_t, list) : NULL;
+}
+
+static inline bool cas_next(element_t *e, element_t *old, element_t *new)
+{
+    struct list_head *o = old ? &old->list : NULL;
+    return __atomic_compare_exchange_n(&e->list.next, &o, &new->list, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static inline bool cas_ptr(element_t **p, element_t *old, element_t *new)
+{
+    return __atomic_compare_exchange_n(p, &old, new, false, __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED);
+}
+
+static inline element_t *load_ptr(element_t **p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+/* Publish a hazard pointer; it must be visible before p is re-validated */
+static inline void hp_set(int i, element_t *p)
+{
+    __atomic_store_n(&hp_self->hp[i], p, __ATOMIC_SEQ_CST);
+}
+
+static inline void hp_clear()
+{
+    for (int i = 0; i < HP_PER_THREAD; i++)
+        __atomic_store_n(&hp_self->hp[i], NULL, __ATOMIC_RELEASE);
+}
+
+static void node_free(element_t *e)
+{
+    test_free(e);
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(element_t *const *) a;
+    uintptr_t y = (uintptr_t) *(element_t *const *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Free the retired nodes of rec that no thread holds a hazard pointer to */
+static void hp_scan(hp_rec_t *rec)
+{
+    size_t n = __atomic_load_n(&hp_count, __ATOMIC_ACQUIRE) * HP_PER_THREAD;
+    element_t **hazards = malloc((n ? n : 1) * sizeof(element_t *));
+    if (!hazards)
+        return;
+
+    size_t nh = 0;
+    for (hp_rec_t *r = __atomic_load_n(&hp_list, __ATOMIC_ACQUIRE);
+         r && nh < n; r = r->next) {
+        for (int i = 0; i < HP_PER_THREAD && nh < n; i++) {
+            element_t *p = __atomic_load_n(&r->hp[i], __ATOMIC_ACQUIRE);
+            if (p)
+                hazards[nh++] = p;
+        }
+    }
+    qsort(hazards, nh, sizeof(element_t *), ptr_cmp);
+
+    size_t keep = 0;
+    for (size_t i = 0; i < rec->nretired; i++) {
+        element_t *e = rec->retired[i];
+        if (bsearch(&e, hazards, nh, sizeof(element_t *), ptr_cmp))
+            rec->retired[keep++] = e;
+        else
+            node_free(e);
+    }
+    rec->nretired = keep;
+    free(hazards);
+}
+
+static void hp_retire(element_t *e)
+{
+    hp_rec_t *rec = hp_self;
+    if (rec->nretired == rec->cap) {
+        size_t cap = rec->cap ? rec->cap << 1 : HP_SCAN_MIN;
+        element_t **r = realloc(rec->retired, cap * sizeof(element_t *));
+        if (!r) {
+            /* Keep the node around rather than risk freeing it early */
+            hp_scan(rec);
+            if (rec->nretired == rec->cap)
+                return;
+        } else {
+            rec->retired = r;
+            rec->cap = cap;
+        }
+    }
+    rec->retired[rec->nretired++] = e;
+
+    size_t threshold =
+        HP_SCAN_MIN +
+        2 * HP_PER_THREAD * __atomic_load_n(&hp_count, __ATOMIC_RELAXED);
+    if (rec->nretired >= threshold)
+        hp_scan(rec);
+}
+
+/* Hand the record of an exiting thread back for reuse */
+static void hp_release(void *arg)
+{
+    hp_rec_t *rec = arg;
+    for (int i = 0; i < HP_PER_THREAD; i++)
+        __atomic_store_n(&rec->hp[i], NULL, __ATOMIC_RELEASE);
+    hp_scan(rec);
+    hp_self = NULL;
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+}
+
+static void hp_key_init()
+{
+    pthread_key_create(&hp_key, hp_release);
+}
+
+/* Attach a hazard pointer record to the calling thread */
+static bool hp_acquire()
+{
+    if (hp_self)
+        return true;
+    pthread_once(&hp_once, hp_key_init);
+
+    hp_rec_t *rec;
+    for (rec = __atomic_load_n(&hp_list, __ATOMIC_ACQUIRE); rec;
+         rec = rec->next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&rec->active, &idle, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!rec) {
+        rec = calloc(1, sizeof(hp_rec_t));
+        if (!rec)
+            return false;
+        rec->active = 1;
+        rec->next = __atomic_load_n(&hp_list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&hp_list, &rec->next, rec, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        __atomic_fetch_add(&hp_count, 1, __ATOMIC_RELEASE);
+    }
+
+    hp_self = rec;
+    pthread_setspecific(hp_key, rec);
+    return true;
+}
+
+static element_t *node_new(char *value)
+{
+    element_t *e = test_malloc(sizeof(element_t));
+    if (!e)
+        return NULL;
+    e->value = value;
+    e->interned = false;
+    e->list.next = NULL;
+    e->list.prev = NULL;
+    return e;
+}
+
+mpmc_t *mpmc_new()
+{
+    mpmc_t *q;
+    if (posix_memalign((void **) &q, CACHE_LINE, sizeof(mpmc_t)))
+        return NULL;
+    element_t *dummy = node_new(NULL);
+    if (!dummy) {
+        free(q);
+        return NULL;
+    }
+    q->head = q->tail = dummy;
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    if (!q)
+        return;
+
+    /* Every node past the dummy still owns its string */
+    element_t *e = q->head, *next;
+    for (bool dummy = true; e; e = next, dummy = false) {
+        next = next_of(e);
+        if (!dummy)
+            test_free(e->value);
+        node_free(e);
+    }
+    free(q);
+}
+
+bool mpmc_insert_tail(mpmc_t *q, const char *s)
+{
+    if (!s || !hp_acquire())
+        return false;
+
+    char *value = test_strdup(s);
+    if (!value)
+        return false;
+    element_t *node = node_new(value);
+    if (!node) {
+        test_free(value);
+        return false;
+    }
+
+    element_t *t;
+    while (true) {
+        t = load_ptr(&q->tail);
+        hp_set(0, t);
+        if (t != load_ptr(&q->tail))
+            continue;
+
+        element_t *next = next_of(t);
+        if (t != load_ptr(&q->tail))
+            continue;
+        if (next) {
+            /* Tail is lagging behind, help it along */
+            cas_ptr(&q->tail, t, next);
+            continue;
+        }
+        if (cas_next(t, NULL, node))
+            break;
+    }
+    cas_ptr(&q->tail, t, node);
+    hp_clear();
+    return true;
+}
+
+char *mpmc_remove_head(mpmc_t *q)
+{
+    if (!hp_acquire())
+        return NULL;
+
+    element_t *h;
+    char *value;
+    while (true) {
+        h = load_ptr(&q->head);
+        hp_set(0, h);
+        if (h != load_ptr(&q->head))
+            continue;
+
+        element_t *t = load_ptr(&q->tail);
+        element_t *next = next_of(h);
+        hp_set(1, next);
+        if (h != load_ptr(&q->head))
+            continue;
+        if (!next) {
+            hp_clear();
+            return NULL;
+        }
+        if (h == t) {
+            cas_ptr(&q->tail, t, next);
+            continue;
+        }
+
+        /* next is protected, and its value is only taken by the winner */
+        value = next->value;
+        if (cas_ptr(&q->head, h, next))
+            break;
+    }
+    hp_clear();
+    hp_retire(h);
+    return value;
+}
+
+void mpmc_reclaim()
+{
+    for (hp_rec_t *rec = hp_list; rec; rec = rec->next) {
+        for (size_t i = 0; i < rec->nretired; i++)
+            node_free(rec->retired[i]);
+        rec->nretired = 0;
+    }
+}
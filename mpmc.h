@@ -0,0 +1,57 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+/*
+ * Lock-free multi-producer, multi-consumer queue of strings.
+ *
+ * This is the Michael-Scott queue: a singly linked list of element_t nodes
+ * behind a dummy node, with the head and tail pointers advanced by
+ * compare-and-swap.  Any number of threads may insert at the tail and remove
+ * from the head concurrently.  Nodes unlinked by a removal are reclaimed
+ * with hazard pointers, so a thread still reading a node never sees it
+ * freed under its feet, and no thread ever blocks another.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct mpmc mpmc_t;
+
+/*
+ * Create an empty queue.
+ * Return NULL if could not allocate space.
+ */
+mpmc_t *mpmc_new();
+
+/*
+ * Free all storage used by queue, including the strings still in it.
+ * No other thread may be using q.
+ */
+void mpmc_free(mpmc_t *q);
+
+/*
+ * Attempt to insert a copy of s at tail of queue, like q_insert_tail.
+ * Return true if successful.
+ * Return false if s is NULL or could not allocate space.
+ */
+bool mpmc_insert_tail(mpmc_t *q, const char *s);
+
+/*
+ * Attempt to remove the string at head of queue.
+ * Unlike q_remove_head, the string itself is handed over to the caller, who
+ * must free it with test_free, since the node holding it stays behind as the
+ * new dummy.
+ * Return NULL if queue is empty.
+ */
+char *mpmc_remove_head(mpmc_t *q);
+
+/*
+ * Free every node retired by any thread.
+ * Only safe while no thread is operating on any mpmc queue, for instance
+ * after all workers have been joined.
+ */
+void mpmc_reclaim();
+
+#endif /* LAB0_MPMC_H */
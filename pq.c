@@ -0,0 +1,147 @@
+/* Pairing heap on top of element_t nodes */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "harness.h"
+#include "pq.h"
+
+static inline element_t *to_element(struct list_head *l)
+{
+    return l ? list_entry(l, element_t, list) : NULL;
+}
+
+static inline element_t *child_of(element_t *e)
+{
+    return to_element(e->list.prev);
+}
+
+static inline element_t *sibling_of(element_t *e)
+{
+    return to_element(e->list.next);
+}
+
+static inline void set_child(element_t *e, element_t *c)
+{
+    e->list.prev = c ? &c->list : NULL;
+}
+
+static inline void set_sibling(element_t *e, element_t *s)
+{
+    e->list.next = s ? &s->list : NULL;
+}
+
+/* Link two heaps, the root with the larger string becoming a child */
+static element_t *meld(element_t *a, element_t *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (strcasecmp(b->value, a->value) < 0) {
+        element_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    set_sibling(b, child_of(a));
+    set_child(a, b);
+    return a;
+}
+
+/*
+ * Standard two-pass merge of a sibling chain: meld adjacent pairs from left
+ * to right, then fold the results from right to left.  The pairs are kept on
+ * a stack threaded through the sibling links, so no recursion is needed.
+ */
+static element_t *merge_pairs(element_t *first)
+{
+    element_t *stack = NULL;
+    while (first) {
+        element_t *a = first, *b = sibling_of(a);
+        first = b ? sibling_of(b) : NULL;
+        set_sibling(a, NULL);
+        if (b)
+            set_sibling(b, NULL);
+        a = meld(a, b);
+        set_sibling(a, stack);
+        stack = a;
+    }
+
+    element_t *root = NULL;
+    while (stack) {
+        element_t *next = sibling_of(stack);
+        set_sibling(stack, NULL);
+        root = meld(stack, root);
+        stack = next;
+    }
+    return root;
+}
+
+void pq_init(pq_t *pq)
+{
+    pq->root = NULL;
+    pq->size = 0;
+}
+
+void pq_free(pq_t *pq)
+{
+    /*
+     * Hoist the first child of the front node in front of it until the
+     * front node has no children left, then free it.  Each node is moved
+     * at most once, so this takes linear time without extra storage.
+     */
+    element_t *work = pq->root;
+    while (work) {
+        element_t *c = child_of(work);
+        if (c) {
+            set_child(work, sibling_of(c));
+            set_sibling(c, work);
+            work = c;
+        } else {
+            element_t *next = sibling_of(work);
+            q_release_element(work);
+            work = next;
+        }
+    }
+    pq_init(pq);
+}
+
+bool pq_insert(pq_t *pq, const char *s)
+{
+    if (!s)
+        return false;
+
+    element_t *e = malloc(sizeof(element_t));
+    if (!e)
+        return false;
+    e->value = strdup(s);
+    e->interned = false;
+    if (!e->value) {
+        free(e);
+        return false;
+    }
+    set_child(e, NULL);
+    set_sibling(e, NULL);
+
+    pq->root = meld(pq->root, e);
+    pq->size++;
+    return true;
+}
+
+element_t *pq_peek(pq_t *pq)
+{
+    return pq->root;
+}
+
+element_t *pq_pop(pq_t *pq)
+{
+    element_t *e = pq->root;
+    if (!e)
+        return NULL;
+
+    pq->root = merge_pairs(child_of(e));
+    pq->size--;
+    INIT_LIST_HEAD(&e->list);
+    return e;
+}
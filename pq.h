@@ -0,0 +1,47 @@
+#ifndef LAB0_PQ_H
+#define LAB0_PQ_H
+
+/*
+ * Priority queue of strings, smallest first under strcasecmp order.
+ *
+ * The queue is a pairing heap made of the same element_t nodes as the FIFO
+ * queue, so popped elements are released with q_release_element.  While an
+ * element sits in the heap its list_head is reused for the heap links:
+ * list.prev points at the first child and list.next at the next sibling.
+ * Insertion takes O(1), popping the minimum O(log n) amortized.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct {
+    element_t *root; /* Minimum element, NULL when empty */
+    size_t size;
+} pq_t;
+
+/* Initialize an empty priority queue */
+void pq_init(pq_t *pq);
+
+/* Free all elements of pq and leave it empty */
+void pq_free(pq_t *pq);
+
+/*
+ * Attempt to insert a copy of s.
+ * Return true if successful.
+ * Return false if s is NULL or could not allocate space.
+ */
+bool pq_insert(pq_t *pq, const char *s);
+
+/* Return the minimum element without removing it, NULL if pq is empty */
+element_t *pq_peek(pq_t *pq);
+
+/*
+ * Remove the minimum element.
+ * Return it, with its list_head reinitialized, or NULL if pq is empty.
+ * Like q_remove_head, the element is not freed.
+ */
+element_t *pq_pop(pq_t *pq);
+
+#endif /* LAB0_PQ_H */
@@ -0,0 +1,303 @@
+/*
+ * Load generator for qtest -s.
+ *
+ * Opens a number of connections to the server and keeps a number of
+ * commands in flight on each, cycling through the lines of a command file,
+ * then reports throughput and latency.  The latency of a command runs from
+ * when it is queued for sending to when its ":ok" or ":err" line arrives.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONNS 1024
+#define MAX_LINE 4096
+
+typedef struct {
+    int fd;
+    size_t sent, done;
+    double *stamps; /* Send time of each command in flight, by sent % depth */
+    char in[65536];
+    size_t in_len;
+    char *out;
+    size_t out_len, out_pos, out_size;
+} conn_t;
+
+static char **cmds;
+static size_t ncmds;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *xmalloc(size_t n)
+{
+    void *p = malloc(n);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void usage(char *prog)
+{
+    printf("Usage: %s -s SOCK [-c CONNS] [-d DEPTH] [-n COUNT] [-f FILE] "
+           "[-i INIT]\n",
+           prog);
+    printf("\t-s SOCK   Socket qtest -s listens at\n");
+    printf("\t-c CONNS  Number of connections (default 4)\n");
+    printf("\t-d DEPTH  Commands in flight on each connection (default 16)\n");
+    printf("\t-n COUNT  Number of commands in all (default 100000)\n");
+    printf("\t-f FILE   Cycle through the lines of FILE\n"
+           "\t          (default \"ih dolphin\" and \"rh dolphin\")\n");
+    printf("\t-i INIT   Run INIT before starting (default \"new\")\n");
+    exit(0);
+}
+
+static void add_cmd(const char *line)
+{
+    size_t len = strlen(line);
+    char *cmd = xmalloc(len + 2);
+    memcpy(cmd, line, len);
+    strcpy(cmd + len, "\n");
+    cmds = realloc(cmds, (ncmds + 1) * sizeof(char *));
+    if (!cmds) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    cmds[ncmds++] = cmd;
+}
+
+static void load_cmds(const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open '%s'\n", fname);
+        exit(1);
+    }
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0])
+            add_cmd(line);
+    }
+    fclose(f);
+    if (!ncmds) {
+        fprintf(stderr, "No commands in '%s'\n", fname);
+        exit(1);
+    }
+}
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        fprintf(stderr, "Could not connect to '%s': %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+/* Run one command and wait for it, echoing its output */
+static void run_init(const char *path, const char *init)
+{
+    int fd = connect_to(path);
+    char buf[MAX_LINE];
+    snprintf(buf, sizeof(buf), "%s\nquit\n", init);
+    if (write(fd, buf, strlen(buf)) < 0) {
+        perror("write");
+        exit(1);
+    }
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, n, stdout);
+    close(fd);
+}
+
+/* Queue up commands for a connection, up to the depth and its quota */
+static void fill(conn_t *c, size_t depth, size_t quota)
+{
+    double t = now();
+    while (c->sent - c->done < depth && c->sent < quota) {
+        const char *cmd = cmds[c->sent % ncmds];
+        size_t len = strlen(cmd);
+        if (c->out_len + len > c->out_size) {
+            c->out_size = 2 * (c->out_len + len);
+            c->out = realloc(c->out, c->out_size);
+            if (!c->out) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        memcpy(c->out + c->out_len, cmd, len);
+        c->out_len += len;
+        c->stamps[c->sent % depth] = t;
+        c->sent++;
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    char *path = NULL;
+    char *init = "new";
+    size_t nconns = 4, depth = 16, count = 100000;
+    int c;
+
+    while ((c = getopt(argc, argv, "hs:c:d:n:f:i:")) != -1) {
+        switch (c) {
+        case 's':
+            path = optarg;
+            break;
+        case 'c':
+            nconns = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            load_cmds(optarg);
+            break;
+        case 'i':
+            init = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!path || !nconns || nconns > MAX_CONNS || !depth || !count)
+        usage(argv[0]);
+    if (!ncmds) {
+        add_cmd("ih dolphin");
+        add_cmd("rh dolphin");
+    }
+    if (*init)
+        run_init(path, init);
+
+    conn_t *conns = xmalloc(nconns * sizeof(conn_t));
+    struct pollfd *pfds = xmalloc(nconns * sizeof(struct pollfd));
+    double *lat = xmalloc(count * sizeof(double));
+    size_t nlat = 0, errors = 0;
+    for (size_t i = 0; i < nconns; i++) {
+        conn_t *cn = &conns[i];
+        memset(cn, 0, sizeof(*cn));
+        cn->fd = connect_to(path);
+        fcntl(cn->fd, F_SETFL, O_NONBLOCK);
+        cn->stamps = xmalloc(depth * sizeof(double));
+    }
+
+    double start = now();
+    size_t active = nconns;
+    while (active) {
+        for (size_t i = 0; i < nconns; i++) {
+            conn_t *cn = &conns[i];
+            /* Spread the commands, with the remainder on the first ones */
+            size_t quota = count / nconns + (i < count % nconns);
+            fill(cn, depth, quota);
+            pfds[i].fd = cn->done < quota ? cn->fd : -1;
+            pfds[i].events =
+                POLLIN | (cn->out_pos < cn->out_len ? POLLOUT : 0);
+        }
+        if (poll(pfds, nconns, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+
+        for (size_t i = 0; i < nconns; i++) {
+            conn_t *cn = &conns[i];
+            if (pfds[i].revents & POLLOUT) {
+                ssize_t n = write(cn->fd, cn->out + cn->out_pos,
+                                  cn->out_len - cn->out_pos);
+                if (n > 0)
+                    cn->out_pos += n;
+                if (cn->out_pos == cn->out_len)
+                    cn->out_pos = cn->out_len = 0;
+            }
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            ssize_t n = read(cn->fd, cn->in + cn->in_len,
+                             sizeof(cn->in) - cn->in_len);
+            if (n <= 0) {
+                if (n < 0 && errno == EAGAIN)
+                    continue;
+                fprintf(stderr, "Server closed connection %zu\n", i);
+                return 1;
+            }
+            cn->in_len += n;
+
+            double t = now();
+            char *line = cn->in, *end = cn->in + cn->in_len, *nl;
+            while ((nl = memchr(line, '\n', end - line))) {
+                bool ok = nl - line == 3 && !memcmp(line, ":ok", 3);
+                bool err = nl - line == 4 && !memcmp(line, ":err", 4);
+                if (ok || err) {
+                    lat[nlat++] = t - cn->stamps[cn->done % depth];
+                    cn->done++;
+                    errors += err;
+                }
+                line = nl + 1;
+            }
+            cn->in_len = end - line;
+            /* Output longer than the buffer is dropped, it is not needed */
+            if (cn->in_len == sizeof(cn->in))
+                cn->in_len = 0;
+            memmove(cn->in, line, cn->in_len);
+        }
+
+        active = 0;
+        for (size_t i = 0; i < nconns; i++)
+            active += conns[i].done < count / nconns + (i < count % nconns);
+    }
+    double elapsed = now() - start;
+
+    qsort(lat, nlat, sizeof(double), cmp_double);
+    printf("%zu commands over %zu connections, %zu in flight on each\n", nlat,
+           nconns, depth);
+    printf("%.3f seconds, %.0f commands/sec, %zu errors\n", elapsed,
+           nlat / elapsed, errors);
+    printf("Latency p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           lat[nlat / 2] * 1e6, lat[nlat * 99 / 100] * 1e6,
+           lat[nlat - 1] * 1e6);
+
+    for (size_t i = 0; i < nconns; i++) {
+        close(conns[i].fd);
+        free(conns[i].stamps);
+        free(conns[i].out);
+    }
+    free(conns);
+    free(pfds);
+    free(lat);
+    return errors != 0;
+}
@@ -2,6 +2,9 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -33,8 +36,16 @@
  */
 #include "queue.h"
 
+#include "bq.h"
 #include "console.h"
+#include "intern.h"
+#include "lru.h"
+#include "mpmc.h"
+#include "pq.h"
 #include "report.h"
+#include "server.h"
+#include "tw.h"
+#include "ws.h"
 
 /* Settable parameters */
 
@@ -43,7 +54,6 @@
 /*
  * How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
@@ -65,6 +75,9 @@ static size_t lcnt = 0;
 
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST;
+
+/* Seed of random strings and of injected malloc failures */
+static int seed = 1;
 static int fail_count = 0;
 
 static int string_length = MAXSTRING;
@@ -73,8 +86,32 @@ static int string_length = MAXSTRING;
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
+/* Vocabulary size and exponent of the ZIPF workload */
+#define ZIPF_WORDS 1000
+#define ZIPF_EXPONENT 1.0
+static double *zipf_cdf = NULL;
+
+/* Share duplicate strings through the interning pool */
+static int intern_mode = 0;
+
+/* Cache driven by the lru commands, NULL until created */
+static lru_t *lru_cache = NULL;
+
+/* Room for each key of the lbench trace */
+#define LRU_KEY_LEN 16
+
+/* Priority queue driven by the pq commands */
+static pq_t prio_queue;
+
+/* Delayed queue driven by dq, dcancel and tick, delivering into the queue */
+static tw_t delay_queue;
+
+/* Upper bound on worker threads of the concurrent queue commands */
+#define MAX_THREADS 64
+
 /* Forward declarations */
 static bool show_queue(int vlevel);
+static bool side_blocks();
 
 static bool do_free(int argc, char *argv[])
 {
@@ -88,12 +125,9 @@ static bool do_free(int argc, char *argv[])
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
 
     l_meta.size = 0;
     l_meta.l = NULL;
@@ -101,7 +135,7 @@ static bool do_free(int argc, char *argv[])
     show_queue(3);
 
     size_t bcnt = allocation_check();
-    if (bcnt > 0) {
+    if (bcnt > 0 && !side_blocks()) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
         ok = false;
@@ -151,6 +185,162 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/*
+ * Draw a word from a Zipf-distributed vocabulary: the k-th most frequent
+ * word shows up with probability proportional to 1 / k^ZIPF_EXPONENT.
+ */
+static void fill_zipf_string(char *buf, size_t buf_size)
+{
+    if (!zipf_cdf) {
+        zipf_cdf = malloc_or_fail(ZIPF_WORDS * sizeof(double), "zipf");
+        double sum = 0;
+        for (int k = 0; k < ZIPF_WORDS; k++)
+            zipf_cdf[k] = sum += 1.0 / pow(k + 1, ZIPF_EXPONENT);
+        for (int k = 0; k < ZIPF_WORDS; k++)
+            zipf_cdf[k] /= sum;
+    }
+
+    double u = (double) rand() / RAND_MAX;
+    int lo = 0, hi = ZIPF_WORDS - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* Spell the rank in letters so the words look like the RAND ones */
+    size_t len = 0;
+    buf[len++] = 'z';
+    do {
+        buf[len++] = charset[lo % (sizeof charset - 1)];
+        lo /= sizeof charset - 1;
+    } while (lo && len < buf_size - 1);
+    buf[len] = '\0';
+}
+
+/* Pick the generator for the special RAND and ZIPF strings, if any */
+static void (*string_generator(const char *s))(char *, size_t)
+{
+    if (!strcmp(s, "RAND"))
+        return fill_rand_string;
+    if (!strcmp(s, "ZIPF"))
+        return fill_zipf_string;
+    return NULL;
+}
+
+/*
+ * Hand a freshly allocated copy of s over to the queue, the way a producer
+ * that already holds a heap string would.  The copy is made through the
+ * harness allocator so that the queue is allowed to free it later.
+ */
+static bool insert_owned(bool tail, char *s, char **dup)
+{
+    char *buf = test_strdup(s);
+    if (!buf)
+        return false;
+
+    bool rval = tail ? q_insert_tail_owned(l_meta.l, buf)
+                     : q_insert_head_owned(l_meta.l, buf);
+    if (!rval) {
+        test_free(buf);
+        return false;
+    }
+
+    *dup = buf;
+    return true;
+}
+
+/*
+ * Insert reps copies of inserts, or reps generated strings when fill is
+ * given, through a single call of the batched insertion API.  This is only
+ * used when no per-element failure accounting is needed, i.e., when malloc
+ * failures are not being injected.
+ */
+static bool insert_batch(bool tail,
+                         char *inserts,
+                         void (*fill)(char *, size_t),
+                         int reps)
+{
+    bool rval;
+    if (fill) {
+        char **strs = malloc(reps * sizeof(char *));
+        char *bufs = malloc((size_t) reps * MAX_RANDSTR_LEN);
+        if (!strs || !bufs) {
+            report(1,
+                   "INTERNAL ERROR.  Could not allocate space for random "
+                   "strings");
+            free(strs);
+            free(bufs);
+            return false;
+        }
+        for (int r = 0; r < reps; r++) {
+            strs[r] = bufs + (size_t) r * MAX_RANDSTR_LEN;
+            fill(strs[r], MAX_RANDSTR_LEN);
+        }
+        rval = tail ? q_insert_tail_n(l_meta.l, (const char *const *) strs,
+                                      reps)
+                    : q_insert_head_n(l_meta.l, (const char *const *) strs,
+                                      reps);
+        free(strs);
+        free(bufs);
+    } else {
+        rval = tail ? q_insert_tail_repeat(l_meta.l, inserts, reps)
+                    : q_insert_head_repeat(l_meta.l, inserts, reps);
+    }
+
+    if (!rval) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Insertion of %d elements failed", reps);
+            return !error_check();
+        }
+        report(1, "ERROR: Insertion of %d elements failed (%d failures total)",
+               reps, fail_count);
+        return false;
+    }
+
+    lcnt += reps;
+    l_meta.size += reps;
+
+    /* Check the two most recently inserted elements, as do_ih does */
+    struct list_head *first = tail ? l_meta.l->prev : l_meta.l->next;
+    struct list_head *second = tail ? first->prev : first->next;
+    char *cur_inserts = list_entry(first, element_t, list)->value;
+    if (!cur_inserts) {
+        report(1, "ERROR: Failed to save copy of string in queue");
+        return false;
+    }
+    if (cur_inserts == inserts) {
+        report(1,
+               "ERROR: Need to allocate and copy string for new queue "
+               "element");
+        return false;
+    }
+    /* Interned elements share their strings on purpose */
+    if (reps > 1 && !intern_mode &&
+        list_entry(second, element_t, list)->value == cur_inserts) {
+        report(1,
+               "ERROR: Need to allocate separate string for each queue "
+               "element");
+        return false;
+    }
+    return !error_check();
+}
+
+/* Report insertion throughput of a repeated ih/it */
+static void report_inserts(size_t inserted, double elapsed)
+{
+    if (inserted < 2)
+        return;
+    if (elapsed > 0)
+        report(3, "Inserted %lu elements in %.3f seconds (%.0f inserts/sec)",
+               inserted, elapsed, inserted / elapsed);
+    else
+        report(3, "Inserted %lu elements", inserted);
+}
+
 /* insert head */
 static bool do_ih(int argc, char *argv[])
 {
@@ -171,34 +361,45 @@ static bool do_ih(int argc, char *argv[])
     char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
-    bool ok = true, need_rand = false;
-    if (argc != 2 && argc != 3) {
+    bool ok = true;
+    bool owned = argc > 1 && !strcmp(argv[1], "-m");
+    int arg = owned ? 2 : 1;
+    if (argc - arg != 1 && argc - arg != 2) {
         report(1, "%s needs 1-2 arguments", argv[0]);
         return false;
     }
 
-    char *inserts = argv[1];
-    if (argc == 3) {
-        if (!get_int(argv[2], &reps)) {
-            report(1, "Invalid number of insertions '%s'", argv[2]);
+    char *inserts = argv[arg];
+    if (argc - arg == 2) {
+        if (!get_int(argv[arg + 1], &reps)) {
+            report(1, "Invalid number of insertions '%s'", argv[arg + 1]);
             return false;
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
-        need_rand = true;
+    void (*fill)(char *, size_t) = string_generator(inserts);
+    if (fill)
         inserts = randstr_buf;
-    }
 
     if (!l_meta.l)
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    /* Per-element checking is only needed while failures are injected */
+    bool batch = !owned && l_meta.l && reps > 1 && !fault_active();
+    size_t start_cnt = lcnt;
+    double start_time;
+    init_time(&start_time);
+
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_head(l_meta.l, inserts);
+        if (batch)
+            ok = insert_batch(false, inserts, fill, reps);
+        for (int r = 0; !batch && ok && r < reps; r++) {
+            if (fill)
+                fill(randstr_buf, sizeof(randstr_buf));
+            char *owned_str = NULL;
+            bool rval = owned ? insert_owned(false, inserts, &owned_str)
+                              : q_insert_head(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
@@ -207,13 +408,20 @@ static bool do_ih(int argc, char *argv[])
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
+                } else if (owned) {
+                    if (cur_inserts != owned_str) {
+                        report(1,
+                               "ERROR: Owned insertion must not copy string");
+                        ok = false;
+                        break;
+                    }
                 } else if (r == 0 && inserts == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if (r == 1 && lasts == cur_inserts && !intern_mode) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
@@ -236,6 +444,7 @@ static bool do_ih(int argc, char *argv[])
         }
     }
     exception_cancel();
+    report_inserts(lcnt - start_cnt, delta_time(&start_time));
 
     show_queue(3);
     return ok;
@@ -260,34 +469,45 @@ static bool do_it(int argc, char *argv[])
 
     char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
-    bool ok = true, need_rand = false;
-    if (argc != 2 && argc != 3) {
+    bool ok = true;
+    bool owned = argc > 1 && !strcmp(argv[1], "-m");
+    int arg = owned ? 2 : 1;
+    if (argc - arg != 1 && argc - arg != 2) {
         report(1, "%s needs 1-2 arguments", argv[0]);
         return false;
     }
 
-    char *inserts = argv[1];
-    if (argc == 3) {
-        if (!get_int(argv[2], &reps)) {
-            report(1, "Invalid number of insertions '%s'", argv[2]);
+    char *inserts = argv[arg];
+    if (argc - arg == 2) {
+        if (!get_int(argv[arg + 1], &reps)) {
+            report(1, "Invalid number of insertions '%s'", argv[arg + 1]);
             return false;
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
-        need_rand = true;
+    void (*fill)(char *, size_t) = string_generator(inserts);
+    if (fill)
         inserts = randstr_buf;
-    }
 
     if (!l_meta.l)
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    /* Per-element checking is only needed while failures are injected */
+    bool batch = !owned && l_meta.l && reps > 1 && !fault_active();
+    size_t start_cnt = lcnt;
+    double start_time;
+    init_time(&start_time);
+
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_tail(l_meta.l, inserts);
+        if (batch)
+            ok = insert_batch(true, inserts, fill, reps);
+        for (int r = 0; !batch && ok && r < reps; r++) {
+            if (fill)
+                fill(randstr_buf, sizeof(randstr_buf));
+            char *owned_str = NULL;
+            bool rval = owned ? insert_owned(true, inserts, &owned_str)
+                              : q_insert_tail(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
@@ -296,6 +516,10 @@ static bool do_it(int argc, char *argv[])
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
+                } else if (owned && cur_inserts != owned_str) {
+                    report(1, "ERROR: Owned insertion must not copy string");
+                    ok = false;
+                    break;
                 }
             } else {
                 fail_count++;
@@ -312,6 +536,8 @@ static bool do_it(int argc, char *argv[])
         }
     }
     exception_cancel();
+    report_inserts(lcnt - start_cnt, delta_time(&start_time));
+
     show_queue(3);
     return ok;
 }
@@ -340,7 +566,9 @@ static bool do_remove(int option, int argc, char *argv[])
     }
 #endif
 
-    if (argc != 1 && argc != 2) {
+    bool owned = argc > 1 && !strcmp(argv[1], "-m");
+    int arg = owned ? 2 : 1;
+    if (argc - arg != 0 && argc - arg != 1) {
         report(1, "%s needs 0-1 arguments", argv[0]);
         return false;
     }
@@ -360,10 +588,10 @@ static bool do_remove(int option, int argc, char *argv[])
         return false;
     }
 
-    bool check = argc > 1;
+    bool check = argc > arg;
     bool ok = true;
     if (check) {
-        strncpy(checks, argv[1], string_length + 1);
+        strncpy(checks, argv[arg], string_length + 1);
         checks[string_length] = '\0';
     }
 
@@ -376,17 +604,30 @@ static bool do_remove(int option, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (exception_setup(true))
-        re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
-                    : q_remove_head(l_meta.l, removes, string_length + 1);
+    char *rs = NULL;
+    if (exception_setup(true)) {
+        if (owned)
+            rs = option ? q_remove_tail_owned(l_meta.l)
+                        : q_remove_head_owned(l_meta.l);
+        else
+            re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
+                        : q_remove_head(l_meta.l, removes, string_length + 1);
+    }
     exception_cancel();
 
-    bool is_null = re ? false : true;
+    bool is_null = owned ? !rs : !re;
 
     if (!is_null) {
-        // q_remove_head and q_remove_tail are not responsible for releasing
-        // node
-        q_release_element(re);
+        if (owned) {
+            /* The string was handed back to us, so it is ours to free */
+            strncpy(removes, rs, string_length + 1);
+            removes[string_length] = '\0';
+            test_free(rs);
+        } else {
+            // q_remove_head and q_remove_tail are not responsible for
+            // releasing node
+            q_release_element(re);
+        }
 
         removes[string_length + STRINGPAD] = '\0';
         if (removes[0] == '\0') {
@@ -422,68 +663,1322 @@ static bool do_remove(int option, int argc, char *argv[])
         }
     }
 
-    if (ok && check && strcmp(removes, checks)) {
-        report(1, "ERROR: Removed value %s != expected value %s", removes,
-               checks);
-        ok = false;
+    if (ok && check && strcmp(removes, checks)) {
+        report(1, "ERROR: Removed value %s != expected value %s", removes,
+               checks);
+        ok = false;
+    }
+
+    show_queue(3);
+
+    free(removes);
+    free(checks);
+    return ok && !error_check();
+}
+
+static inline bool do_rh(int argc, char *argv[])
+{
+    return do_remove(0, argc, argv);
+}
+
+static inline bool do_rt(int argc, char *argv[])
+{
+    return do_remove(1, argc, argv);
+}
+
+/* remove head quietly */
+static bool do_rhq(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    bool ok = true;
+    if (!l_meta.size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    element_t *re = NULL;
+
+    if (exception_setup(true))
+        re = q_remove_head(l_meta.l, NULL, 0);
+    exception_cancel();
+
+    if (re) {
+        // q_remove_head and q_remove_tail are not responsible for releasing
+        // node
+        q_release_element(re);
+
+        report(2, "Removed element from queue");
+        lcnt--;
+        l_meta.size--;
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Removal failed");
+        else {
+            report(1, "ERROR: Removal failed (%d failures total)", fail_count);
+            ok = false;
+        }
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* remove n elements from head in one batch */
+static bool do_rhn(int argc, char *argv[])
+{
+    if (simulation) {
+        if (argc != 1) {
+            report(1, "%s does not need arguments in simulation mode", argv[0]);
+            return false;
+        }
+        bool ok = is_remove_head_n_const();
+        if (!ok) {
+            report(1, "ERROR: Probably not constant time");
+            return false;
+        }
+        report(1, "Probably constant time");
+        return ok;
+    }
+
+    int n = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &n) || n < 0) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
+        return false;
+    }
+
+    element_t **out = malloc((n ? n : 1) * sizeof(element_t *));
+    if (!out) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed "
+               "elements");
+        return false;
+    }
+
+    if (!l_meta.size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    /*
+     * lcnt is not maintained by dedup and dm, so count the elements that
+     * are expected to go instead of relying on it.
+     */
+    size_t expect = 0;
+    if (l_meta.l) {
+        for (struct list_head *cur = l_meta.l->next;
+             cur != l_meta.l && expect < (size_t) n; cur = cur->next)
+            expect++;
+    }
+
+    size_t cnt = 0;
+    if (exception_setup(true))
+        cnt = q_remove_head_n(l_meta.l, out, n);
+    exception_cancel();
+
+    bool ok = true;
+    if (cnt != expect) {
+        report(1, "ERROR: Removed %lu elements, but expected %lu", cnt,
+               expect);
+        ok = false;
+    }
+
+    // q_remove_head_n is not responsible for releasing nodes
+    if (exception_setup(true))
+        q_release_elements(out, cnt);
+    exception_cancel();
+
+    report(2, "Removed %lu elements from queue", cnt);
+    lcnt = lcnt > cnt ? lcnt - cnt : 0;
+    l_meta.size = l_meta.size > cnt ? l_meta.size - cnt : 0;
+    free(out);
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static void intern_changed(int oldval)
+{
+    q_set_intern(intern_mode != 0);
+}
+
+static void check_changed(int oldval)
+{
+    if (check_level < CHECK_CANARY || check_level > CHECK_FULL) {
+        report(1, "Checking level must be between %d and %d", CHECK_CANARY,
+               CHECK_FULL);
+        check_level = oldval;
+    }
+}
+
+static void sample_changed(int oldval)
+{
+    if (check_sample < 1) {
+        report(1, "Sampling interval must be positive");
+        check_sample = oldval;
+    }
+}
+
+static void seed_changed(int oldval)
+{
+    srand((unsigned int) seed);
+    fault_seed((uint64_t) seed);
+}
+
+static bool do_fault(int argc, char *argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "nth")) {
+        int n;
+        if (!get_int(argv[2], &n) || n < 0) {
+            report(1, "Invalid allocation number '%s'", argv[2]);
+            return false;
+        }
+        fault_fail_nth(n);
+    } else if (argc >= 2 && !strcmp(argv[1], "op")) {
+        uint64_t mask = 0;
+        for (int i = 2; i < argc; i++) {
+            int k;
+            if (!get_int(argv[i], &k) || k < 1 || k > 64) {
+                report(1, "Invalid allocation number '%s' (1 to 64)",
+                       argv[i]);
+                return false;
+            }
+            mask |= 1ull << (k - 1);
+        }
+        fault_set_schedule(mask);
+    } else if (argc == 2 && !strcmp(argv[1], "off")) {
+        fault_fail_nth(0);
+        fault_set_schedule(0);
+        fail_probability = 0;
+    } else if (argc != 1) {
+        report(1, "%s takes no arguments, nth n, op [i...] or off", argv[0]);
+        return false;
+    }
+
+    fault_stat_t st;
+    fault_status(&st);
+    char sched[3 * 64 + 1] = "none";
+    for (int i = 0, len = 0; i < 64; i++) {
+        if ((st.schedule >> i) & 1)
+            len += sprintf(sched + len, "%s%d", len ? " " : "", i + 1);
+    }
+    report(1, "Seed %lu, malloc %d%%, allocation %lu from now, per operation "
+           "%s: %lu failures injected",
+           (unsigned long) st.seed, fail_probability, st.countdown, sched,
+           st.injected);
+    return true;
+}
+
+/* Allocations made by each command, as recorded by profile_hook */
+#define MAX_PROFILED 128
+
+typedef struct {
+    const char *name;
+    size_t calls, allocs, frees, bytes;
+} cmd_prof_t;
+
+static cmd_prof_t cmd_prof[MAX_PROFILED];
+static int cmd_prof_cnt = 0;
+
+/*
+ * Commands can run others, as time does, so the commands running are
+ * kept on a stack.  Each is charged what it allocated less what the
+ * commands nested in it did, so that nothing is counted twice.
+ */
+#define PROF_DEPTH 16
+
+typedef struct {
+    size_t allocs, frees, bytes;
+} prof_count_t;
+
+static struct {
+    prof_count_t start;
+    prof_count_t nested;
+} prof_stack[PROF_DEPTH];
+static int prof_depth = 0;
+
+/* Where to dump the allocation profile at exit, if anywhere */
+static char *memdump_name = NULL;
+
+static void prof_counts(prof_count_t *c)
+{
+    alloc_stat_t st;
+    alloc_stats(&st);
+    c->allocs = st.allocs;
+    c->frees = st.frees;
+    c->bytes = st.bytes;
+}
+
+static void profile_hook(const char *name, bool done)
+{
+    if (!done) {
+        /* Anything deeper is charged to the innermost command kept */
+        if (prof_depth < PROF_DEPTH) {
+            prof_counts(&prof_stack[prof_depth].start);
+            memset(&prof_stack[prof_depth].nested, 0, sizeof(prof_count_t));
+        }
+        prof_depth++;
+        return;
+    }
+
+    if (--prof_depth >= PROF_DEPTH)
+        return;
+
+    prof_count_t now, *start = &prof_stack[prof_depth].start;
+    prof_counts(&now);
+    size_t allocs = now.allocs - start->allocs;
+    size_t frees = now.frees - start->frees;
+    size_t bytes = now.bytes - start->bytes;
+    if (prof_depth) {
+        prof_count_t *outer = &prof_stack[prof_depth - 1].nested;
+        outer->allocs += allocs;
+        outer->frees += frees;
+        outer->bytes += bytes;
+    }
+
+    /* Command names are literals, so comparing pointers is enough */
+    int i = 0;
+    while (i < cmd_prof_cnt && cmd_prof[i].name != name)
+        i++;
+    if (i == cmd_prof_cnt) {
+        if (cmd_prof_cnt == MAX_PROFILED)
+            return;
+        cmd_prof_cnt++;
+        cmd_prof[i].name = name;
+    }
+
+    prof_count_t *nested = &prof_stack[prof_depth].nested;
+    cmd_prof[i].calls++;
+    cmd_prof[i].allocs += allocs - nested->allocs;
+    cmd_prof[i].frees += frees - nested->frees;
+    cmd_prof[i].bytes += bytes - nested->bytes;
+}
+
+static bool do_memstats(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    alloc_stat_t st;
+    alloc_stats(&st);
+    report(1, "%lu allocations of %lu bytes, %lu frees", st.allocs, st.bytes,
+           st.frees);
+    report(1, "%lu blocks holding %lu bytes live, at most %lu bytes",
+           allocation_check(), st.live_bytes, st.peak_bytes);
+
+    report(1, "Block size        Allocations");
+    for (int i = 0; i < ALLOC_HIST_BUCKETS; i++) {
+        if (!st.hist[i])
+            continue;
+        size_t lo = i ? (size_t) 1 << (i - 1) : 0;
+        size_t hi = i ? lo * 2 - 1 : 0;
+        report(1, "%7lu-%-8lu  %11lu", lo, hi, st.hist[i]);
+    }
+
+    report(1, "Command     Calls  Allocations  Frees        Bytes");
+    for (int i = 0; i < cmd_prof_cnt; i++) {
+        cmd_prof_t *c = &cmd_prof[i];
+        if (c->allocs || c->frees)
+            report(1, "%-10s %6lu  %11lu  %11lu  %11lu", c->name, c->calls,
+                   c->allocs, c->frees, c->bytes);
+    }
+    return true;
+}
+
+/* Write the allocation profile as JSON */
+static void memdump(FILE *f)
+{
+    alloc_stat_t st;
+    alloc_stats(&st);
+    fprintf(f,
+            "{\"allocs\": %lu, \"frees\": %lu, \"bytes\": %lu, "
+            "\"live_bytes\": %lu, \"peak_bytes\": %lu,\n \"histogram\": [",
+            st.allocs, st.frees, st.bytes, st.live_bytes, st.peak_bytes);
+    bool first = true;
+    for (int i = 0; i < ALLOC_HIST_BUCKETS; i++) {
+        if (!st.hist[i])
+            continue;
+        fprintf(f, "%s{\"max\": %lu, \"count\": %lu}", first ? "" : ", ",
+                i ? ((size_t) 1 << (i - 1)) * 2 - 1 : 0, st.hist[i]);
+        first = false;
+    }
+    fprintf(f, "],\n \"commands\": {");
+    for (int i = 0; i < cmd_prof_cnt; i++) {
+        cmd_prof_t *c = &cmd_prof[i];
+        fprintf(f,
+                "%s\n  \"%s\": {\"calls\": %lu, \"allocs\": %lu, "
+                "\"frees\": %lu, \"bytes\": %lu}",
+                i ? "," : "", c->name, c->calls, c->allocs, c->frees,
+                c->bytes);
+    }
+    fprintf(f, "}}\n");
+}
+
+static void budget_changed(int oldval)
+{
+    if (time_budget < 0) {
+        report(1, "Time budget must not be negative");
+        time_budget = oldval;
+        return;
+    }
+    budget_reset();
+}
+
+/* Whether timed operations share one timer, set up for file input */
+static int batch = 0;
+
+static void batch_changed(int oldval)
+{
+    set_batch_mode(batch != 0);
+}
+
+static bool do_budget(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!time_budget) {
+        report(1, "Operations are not timed");
+        return true;
+    }
+
+    long last, peak;
+    budget_stats(&last, &peak);
+    report(1,
+           "Last timed operation used %ld of %d us (%.1f%%), the longest "
+           "%ld us (%.1f%%)",
+           last, time_budget, 100.0 * last / time_budget, peak,
+           100.0 * peak / time_budget);
+    return true;
+}
+
+static bool do_pool(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    intern_stat_t st;
+    intern_stats(&st);
+    report(1, "Interning %s: %lu distinct strings, %lu references",
+           intern_mode ? "on" : "off", st.strings, st.refs);
+    if (st.plain_bytes >= st.pool_bytes)
+        report(1,
+               "Pool uses %lu bytes instead of %lu for private copies "
+               "(%lu bytes saved)",
+               st.pool_bytes, st.plain_bytes, st.plain_bytes - st.pool_bytes);
+    else
+        report(1,
+               "Pool uses %lu bytes instead of %lu for private copies "
+               "(%lu bytes lost)",
+               st.pool_bytes, st.plain_bytes, st.pool_bytes - st.plain_bytes);
+    return true;
+}
+
+/* Linear reference for q_contains, independent of the hash index */
+static bool walk_contains(const char *s)
+{
+    element_t *item;
+    if (!l_meta.l)
+        return false;
+    list_for_each_entry (item, l_meta.l, list) {
+        if (!strcmp(item->value, s))
+            return true;
+    }
+    return false;
+}
+
+static bool do_find(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int reps = 1;
+    if (argc == 3 && (!get_int(argv[2], &reps) || reps < 1)) {
+        report(1, "Invalid number of lookups '%s'", argv[2]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling find on null queue");
+    error_check();
+
+    bool found = false;
+    double start_time;
+    init_time(&start_time);
+    if (exception_setup(true)) {
+        for (int r = 0; r < reps; r++)
+            found = q_contains(l_meta.l, argv[1]);
+    }
+    exception_cancel();
+    double elapsed = delta_time(&start_time);
+
+    bool ok = true;
+    if (found != walk_contains(argv[1])) {
+        report(1, "ERROR: q_contains returned %s for %s",
+               found ? "true" : "false", argv[1]);
+        ok = false;
+    } else {
+        report(1, "%s %s", argv[1], found ? "found" : "not found");
+    }
+    if (reps > 1 && elapsed > 0)
+        report(3, "Looked up %d times in %.3f seconds (%.0f lookups/sec)",
+               reps, elapsed, reps / elapsed);
+
+    return ok && !error_check();
+}
+
+/* remove by value */
+static bool do_rv(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling remove on null queue");
+    error_check();
+
+    bool expect = walk_contains(argv[1]);
+    element_t *re = NULL;
+    if (exception_setup(true))
+        re = q_remove_value(l_meta.l, argv[1]);
+    exception_cancel();
+
+    bool ok = true;
+    if (!re) {
+        if (expect) {
+            report(1, "ERROR: Failed to remove %s from queue", argv[1]);
+            ok = false;
+        } else {
+            report(2, "%s not in queue", argv[1]);
+        }
+    } else {
+        if (strcmp(re->value, argv[1])) {
+            report(1, "ERROR: Removed value %s != expected value %s",
+                   re->value, argv[1]);
+            ok = false;
+        } else {
+            report(2, "Removed %s from queue", argv[1]);
+        }
+        // q_remove_value is not responsible for releasing node
+        q_release_element(re);
+        lcnt = lcnt ? lcnt - 1 : 0;
+        l_meta.size = l_meta.size ? l_meta.size - 1 : 0;
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_index(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l) {
+        report(3, "Warning: Calling index on null queue");
+        return !error_check();
+    }
+
+    int enable = 0;
+    if (argc == 2) {
+        if (!get_int(argv[1], &enable)) {
+            report(1, "Invalid index switch '%s'", argv[1]);
+            return false;
+        }
+        bool ok = false;
+        if (exception_setup(true))
+            ok = q_index_enable(l_meta.l, enable != 0);
+        exception_cancel();
+        if (!ok) {
+            report(1, "ERROR: Could not %s hash index",
+                   enable ? "build" : "drop");
+            return false;
+        }
+    }
+
+    size_t bytes = q_index_bytes(l_meta.l);
+    if (bytes)
+        report(1, "Hash index uses %lu bytes (%.1f per element)", bytes,
+               l_meta.size ? (double) bytes / l_meta.size : 0.0);
+    else
+        report(1, "Hash index is off");
+    return !error_check();
+}
+
+/*
+ * Whether the cache, priority queue or delayed queue hold blocks, which are
+ * not leaked by the queue itself
+ */
+static bool side_blocks()
+{
+    return lru_cache || prio_queue.size || delay_queue.pending;
+}
+
+static void show_lru(int vlevel)
+{
+    if (verblevel < vlevel)
+        return;
+
+    lru_stat_t st;
+    lru_stats(lru_cache, &st);
+    size_t lookups = st.hits + st.misses;
+    report(vlevel,
+           "Cache holds %lu strings: %lu hits, %lu misses, %lu evictions "
+           "(hit rate %.1f%%)",
+           lru_size(lru_cache), st.hits, st.misses, st.evictions,
+           lookups ? 100.0 * st.hits / lookups : 0.0);
+}
+
+static bool lru_exists(const char *cmd)
+{
+    if (lru_cache)
+        return true;
+    report(1, "ERROR: No cache, create one with 'lru n' before %s", cmd);
+    return false;
+}
+
+/* Drop the cache, checking for leaks when it was the last user of memory */
+static bool lru_drop()
+{
+    if (!lru_cache)
+        return true;
+
+    if (exception_setup(true))
+        lru_free(lru_cache);
+    exception_cancel();
+    lru_cache = NULL;
+
+    size_t bcnt = allocation_check();
+    if (bcnt > 0 && !l_meta.l && !side_blocks()) {
+        report(1, "ERROR: Freed cache, but %lu blocks are still allocated",
+               bcnt);
+        return false;
+    }
+    return true;
+}
+
+static bool do_lru(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 1) {
+        if (!lru_exists(argv[0]))
+            return false;
+        show_lru(1);
+        return true;
+    }
+
+    int capacity;
+    if (!get_int(argv[1], &capacity) || capacity < 0) {
+        report(1, "Invalid capacity '%s'", argv[1]);
+        return false;
+    }
+
+    bool ok = lru_drop();
+    if (!capacity)
+        return ok && !error_check();
+
+    if (exception_setup(true))
+        lru_cache = lru_new(capacity);
+    exception_cancel();
+    if (!lru_cache) {
+        report(1, "ERROR: Could not create cache of %d strings", capacity);
+        return false;
+    }
+    return ok && !error_check();
+}
+
+static bool do_lget(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!lru_exists(argv[0]))
+        return false;
+
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = lru_get(lru_cache, argv[1]);
+    exception_cancel();
+
+    bool ok = true;
+    if (e && strcmp(e->value, argv[1])) {
+        report(1, "ERROR: Looked up %s but got %s", argv[1], e->value);
+        ok = false;
+    } else {
+        report(1, "%s %s", argv[1], e ? "hit" : "miss");
+    }
+    if (ok && e &&
+        list_first_entry(lru_list(lru_cache), element_t, list) != e) {
+        report(1, "ERROR: %s is not most recently used after a hit", argv[1]);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+static bool do_lput(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!lru_exists(argv[0]))
+        return false;
+
+    lru_stat_t before;
+    lru_stats(lru_cache, &before);
+
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = lru_put(lru_cache, argv[1]);
+    exception_cancel();
+
+    bool ok = true;
+    if (!e) {
+        fail_count++;
+        if (fail_count < fail_limit)
+            report(2, "Insertion of %s failed", argv[1]);
+        else {
+            report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                   argv[1], fail_count);
+            ok = false;
+        }
+    } else if (strcmp(e->value, argv[1])) {
+        report(1, "ERROR: Stored %s but got %s", argv[1], e->value);
+        ok = false;
+    } else {
+        lru_stat_t after;
+        lru_stats(lru_cache, &after);
+        report(2, "%s %s%s", argv[1],
+               after.hits > before.hits ? "refreshed" : "inserted",
+               after.evictions > before.evictions ? ", evicted oldest" : "");
+    }
+    return ok && !error_check();
+}
+
+static bool do_levict(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    if (!lru_exists(argv[0]))
+        return false;
+
+    bool evicted = false;
+    if (exception_setup(true))
+        evicted = lru_evict(lru_cache);
+    exception_cancel();
+
+    report(2, evicted ? "Evicted least recently used string"
+                      : "Warning: Calling evict on empty cache");
+    return !error_check();
+}
+
+/* Replay a Zipf-distributed key trace against the cache */
+static bool do_lbench(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!lru_exists(argv[0]))
+        return false;
+
+    int n;
+    if (!get_int(argv[1], &n) || n < 1) {
+        report(1, "Invalid number of accesses '%s'", argv[1]);
+        return false;
+    }
+
+    /* Generate the trace up front, so that only the cache is timed */
+    char *keys = malloc((size_t) n * LRU_KEY_LEN);
+    if (!keys) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for keys");
+        return false;
+    }
+    for (int i = 0; i < n; i++)
+        fill_zipf_string(keys + (size_t) i * LRU_KEY_LEN, LRU_KEY_LEN);
+
+    lru_stat_t before, after;
+    lru_stats(lru_cache, &before);
+
+    int done = 0;
+    double start_time;
+    init_time(&start_time);
+    if (exception_setup(true)) {
+        for (; done < n; done++) {
+            if (!lru_put(lru_cache, keys + (size_t) done * LRU_KEY_LEN))
+                break;
+        }
+    }
+    exception_cancel();
+    double elapsed = delta_time(&start_time);
+    free(keys);
+
+    lru_stats(lru_cache, &after);
+    size_t hits = after.hits - before.hits;
+    bool ok = true;
+    if (done != n) {
+        report(1, "ERROR: Access %d of %d failed", done + 1, n);
+        ok = false;
+    }
+    report(1, "Replayed %d Zipf accesses: hit rate %.1f%%", done,
+           done ? 100.0 * hits / done : 0.0);
+    if (elapsed > 0)
+        report(3, "Replayed in %.3f seconds (%.0f ops/sec)", elapsed,
+               done / elapsed);
+    return ok && !error_check();
+}
+
+static bool do_pqins(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int reps = 1;
+    if (argc == 3 && !get_int(argv[2], &reps)) {
+        report(1, "Invalid number of insertions '%s'", argv[2]);
+        return false;
+    }
+
+    char randstr_buf[MAX_RANDSTR_LEN];
+    char *inserts = argv[1];
+    void (*fill)(char *, size_t) = string_generator(inserts);
+    if (fill)
+        inserts = randstr_buf;
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            if (fill)
+                fill(randstr_buf, sizeof(randstr_buf));
+            if (pq_insert(&prio_queue, inserts))
+                continue;
+            fail_count++;
+            if (fail_count < fail_limit)
+                report(2, "Insertion of %s failed", inserts);
+            else {
+                report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                       inserts, fail_count);
+                ok = false;
+            }
+        }
+    }
+    exception_cancel();
+
+    report(3, "Priority queue holds %lu elements", prio_queue.size);
+    return ok && !error_check();
+}
+
+/* pqpeek and pqpop, optionally comparing to the expected minimum */
+static bool do_pq_front(bool pop, int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!prio_queue.size) {
+        report(3, "Warning: Calling %s on empty priority queue", argv[0]);
+        return !error_check();
+    }
+
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = pop ? pq_pop(&prio_queue) : pq_peek(&prio_queue);
+    exception_cancel();
+
+    bool ok = true;
+    if (!e) {
+        report(1, "ERROR: %s returned NULL on a non-empty priority queue",
+               argv[0]);
+        return false;
+    }
+
+    report(2, "%s %s", pop ? "Popped" : "Minimum is", e->value);
+    if (argc == 2 && strcmp(e->value, argv[1])) {
+        report(1, "ERROR: Got %s, but expected %s", e->value, argv[1]);
+        ok = false;
+    }
+
+    if (pop) {
+        element_t *next = pq_peek(&prio_queue);
+        if (next && strcasecmp(next->value, e->value) < 0) {
+            report(1, "ERROR: Popped %s before smaller %s", e->value,
+                   next->value);
+            ok = false;
+        }
+        // pq_pop is not responsible for releasing node
+        q_release_element(e);
+    }
+    return ok && !error_check();
+}
+
+static inline bool do_pqpeek(int argc, char *argv[])
+{
+    return do_pq_front(false, argc, argv);
+}
+
+static inline bool do_pqpop(int argc, char *argv[])
+{
+    return do_pq_front(true, argc, argv);
+}
+
+/*
+ * Time n random keys going through the priority queue against the sorted
+ * queue emulation: after each batch of b insertions, half of a batch is
+ * consumed in order, and the rest is drained at the end.
+ */
+static bool pq_bench_run(bool heap, char *keys, int n, int b, double *elapsed)
+{
+    struct list_head *q = NULL;
+    pq_t pq;
+    bool ok = true;
+    double start_time;
+    init_time(&start_time);
+
+    pq_init(&pq);
+    if (!heap && !(q = q_new()))
+        return false;
+    for (int i = 0; ok && i < n; i += b) {
+        for (int j = i; ok && j < i + b && j < n; j++) {
+            char *key = keys + (size_t) j * MAX_RANDSTR_LEN;
+            ok = heap ? pq_insert(&pq, key) : q_insert_tail(q, key);
+        }
+        if (!heap)
+            q_sort(q);
+        for (int j = 0; ok && j < b / 2; j++) {
+            element_t *e = heap ? pq_pop(&pq) : q_remove_head(q, NULL, 0);
+            q_release_element(e);
+        }
+    }
+    if (heap) {
+        element_t *e;
+        while ((e = pq_pop(&pq)))
+            q_release_element(e);
+    } else {
+        q_free(q);
+    }
+
+    *elapsed = delta_time(&start_time);
+    return ok;
+}
+
+static bool do_pqbench(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int n, b;
+    if (!get_int(argv[1], &n) || n < 1) {
+        report(1, "Invalid number of keys '%s'", argv[1]);
+        return false;
+    }
+    b = n;
+    if (argc == 3 && (!get_int(argv[2], &b) || b < 1)) {
+        report(1, "Invalid batch size '%s'", argv[2]);
+        return false;
+    }
+    if (b > n)
+        b = n;
+
+    char *keys = malloc((size_t) n * MAX_RANDSTR_LEN);
+    if (!keys) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for keys");
+        return false;
+    }
+    for (int i = 0; i < n; i++)
+        fill_rand_string(keys + (size_t) i * MAX_RANDSTR_LEN, MAX_RANDSTR_LEN);
+
+    /* Each side gets its own time budget */
+    double heap_time = 0, sort_time = 0;
+    bool heap_ok = false, sort_ok = false;
+    if (exception_setup(true))
+        heap_ok = pq_bench_run(true, keys, n, b, &heap_time);
+    exception_cancel();
+    if (heap_ok && exception_setup(true))
+        sort_ok = pq_bench_run(false, keys, n, b, &sort_time);
+    exception_cancel();
+    free(keys);
+
+    if (!heap_ok || !sort_ok) {
+        report(1, "ERROR: Could not run %s on %d keys", argv[0], n);
+        return false;
+    }
+    report(1,
+           "%d keys in batches of %d: pairing heap %.3f s, insert+sort "
+           "%.3f s",
+           n, b, heap_time, sort_time);
+    return !error_check();
+}
+
+/* schedule delayed insertion at tail */
+static bool do_dq(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        report(1, "%s needs 2-3 arguments", argv[0]);
+        return false;
+    }
+
+    int delay, reps = 1;
+    if (!get_int(argv[2], &delay) || delay < 0) {
+        report(1, "Invalid delay '%s'", argv[2]);
+        return false;
+    }
+    if (argc == 4 && !get_int(argv[3], &reps)) {
+        report(1, "Invalid number of insertions '%s'", argv[3]);
+        return false;
+    }
+
+    char randstr_buf[MAX_RANDSTR_LEN];
+    char *inserts = argv[1];
+    void (*fill)(char *, size_t) = string_generator(inserts);
+    if (fill)
+        inserts = randstr_buf;
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            if (fill)
+                fill(randstr_buf, sizeof(randstr_buf));
+            // tw_schedule takes over the string, just like the owned inserts
+            char *s = test_strdup(inserts);
+            uint64_t id = tw_schedule(&delay_queue, s, delay);
+            if (id) {
+                report(2, "Scheduled %s as timer %lu, due at tick %lu",
+                       inserts, id, delay_queue.now + delay);
+                continue;
+            }
+            test_free(s);
+            fail_count++;
+            if (fail_count < fail_limit)
+                report(2, "Scheduling of %s failed", inserts);
+            else {
+                report(1, "ERROR: Scheduling of %s failed (%d failures total)",
+                       inserts, fail_count);
+                ok = false;
+            }
+        }
+    }
+    exception_cancel();
+
+    return ok && !error_check();
+}
+
+static bool do_dcancel(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int id;
+    if (!get_int(argv[1], &id) || id < 1) {
+        report(1, "Invalid timer '%s'", argv[1]);
+        return false;
+    }
+
+    char *s = NULL;
+    if (exception_setup(true))
+        s = tw_cancel(&delay_queue, id);
+    exception_cancel();
+
+    if (s) {
+        report(2, "Cancelled timer %d holding %s", id, s);
+        test_free(s);
+    } else {
+        report(2, "Timer %d is not pending", id);
+    }
+    return !error_check();
+}
+
+static bool do_tick(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int ticks = 1;
+    if (argc == 2 && (!get_int(argv[1], &ticks) || ticks < 0)) {
+        report(1, "Invalid number of ticks '%s'", argv[1]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Delivering into null queue is deferred");
+    error_check();
+
+    size_t cnt = 0;
+    if (exception_setup(true))
+        cnt = tw_advance(&delay_queue, ticks, l_meta.l);
+    exception_cancel();
+
+    lcnt += cnt;
+    l_meta.size += cnt;
+    report(2, "Clock at tick %lu: %lu delivered, %lu pending",
+           delay_queue.now, cnt, delay_queue.pending);
+    show_queue(3);
+    return !error_check();
+}
+
+/* Shared state of the mpmc stress test */
+typedef struct {
+    mpmc_t *q;
+    int producers; /* Also the number of consumers */
+    int n;         /* Strings inserted by each producer */
+    int done;      /* Producers finished so far */
+    char *seen;    /* One flag per string, producer-major */
+    int received;
+    int errors;
+} mpmc_stress_t;
+
+typedef struct {
+    mpmc_stress_t *st;
+    int id;
+} mpmc_worker_t;
+
+static void *mpmc_producer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    mpmc_stress_t *st = w->st;
+    char buf[32];
+
+    for (int seq = 0; seq < st->n; seq++) {
+        snprintf(buf, sizeof(buf), "%d:%d", w->id, seq);
+        while (!mpmc_insert_tail(st->q, buf))
+            sched_yield();
+    }
+    __atomic_fetch_add(&st->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Check that every string arrives exactly once, and that each consumer sees
+ * the strings of any one producer in the order they were inserted.
+ */
+static void *mpmc_consumer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    mpmc_stress_t *st = w->st;
+    int last[MAX_THREADS];
+    for (int p = 0; p < st->producers; p++)
+        last[p] = -1;
+
+    while (true) {
+        bool finished =
+            __atomic_load_n(&st->done, __ATOMIC_ACQUIRE) == st->producers;
+        char *s = mpmc_remove_head(st->q);
+        if (!s) {
+            if (finished)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        int p, seq;
+        if (sscanf(s, "%d:%d", &p, &seq) != 2 || p < 0 ||
+            p >= st->producers || seq < 0 || seq >= st->n) {
+            __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+        } else {
+            if (seq <= last[p])
+                __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+            last[p] = seq;
+            if (__atomic_exchange_n(&st->seen[(size_t) p * st->n + seq], 1,
+                                    __ATOMIC_RELAXED))
+                __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&st->received, 1, __ATOMIC_RELAXED);
+        test_free(s);
+    }
+    return NULL;
+}
+
+/* Make sure a concurrent command gave back every block it allocated */
+static bool check_blocks(const char *cmd, size_t before)
+{
+    size_t bcnt = allocation_check();
+    if (bcnt > before) {
+        report(1, "ERROR: %s leaked %lu blocks", cmd, bcnt - before);
+        return false;
     }
+    return true;
+}
 
-    show_queue(3);
-
-    free(removes);
-    free(checks);
-    return ok && !error_check();
+/* Start producer and consumer threads, with the producers first */
+static bool spawn_workers(pthread_t *tid,
+                          mpmc_worker_t *w,
+                          int t,
+                          void *(*producer)(void *),
+                          void *(*consumer)(void *))
+{
+    for (int i = 0; i < 2 * t; i++) {
+        if (pthread_create(&tid[i], NULL, i < t ? producer : consumer,
+                           &w[i])) {
+            report(1, "ERROR: Could not create worker thread");
+            /* Let the started ones finish before giving up */
+            for (int j = 0; j < i; j++)
+                pthread_join(tid[j], NULL);
+            return false;
+        }
+    }
+    for (int i = 0; i < 2 * t; i++)
+        pthread_join(tid[i], NULL);
+    return true;
 }
 
-static inline bool do_rh(int argc, char *argv[])
+static bool do_mpmc(int argc, char *argv[])
 {
-    return do_remove(0, argc, argv);
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int n, t = 4;
+    if (!get_int(argv[1], &n) || n < 1) {
+        report(1, "Invalid number of insertions '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &t) || t < 1 || t > MAX_THREADS / 2)) {
+        report(1, "Invalid number of threads '%s'", argv[2]);
+        return false;
+    }
+
+    size_t blocks = allocation_check();
+    mpmc_stress_t st = {.producers = t, .n = n};
+    st.q = mpmc_new();
+    st.seen = calloc((size_t) t * n, 1);
+    if (!st.q || !st.seen) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for stress test");
+        mpmc_free(st.q);
+        free(st.seen);
+        return false;
+    }
+
+    pthread_t tid[MAX_THREADS];
+    mpmc_worker_t w[MAX_THREADS];
+    for (int i = 0; i < 2 * t; i++) {
+        w[i].st = &st;
+        w[i].id = i < t ? i : i - t;
+    }
+
+    double start_time;
+    init_time(&start_time);
+    bool ok = spawn_workers(tid, w, t, mpmc_producer, mpmc_consumer);
+    double elapsed = delta_time(&start_time);
+
+    size_t missing = 0;
+    for (size_t i = 0; i < (size_t) t * n; i++)
+        missing += !st.seen[i];
+    if (ok && (st.errors || missing || st.received != t * n)) {
+        report(1,
+               "ERROR: %d out-of-order or duplicate strings, %lu missing, "
+               "%d received",
+               st.errors, missing, st.received);
+        ok = false;
+    } else if (ok) {
+        report(1, "%d producers and %d consumers passed %d strings", t, t,
+               t * n);
+        report(3, "Passed in %.3f seconds (%.0f strings/sec)", elapsed,
+               elapsed > 0 ? st.received / elapsed : 0.0);
+    }
+
+    mpmc_free(st.q);
+    mpmc_reclaim();
+    free(st.seen);
+    return check_blocks(argv[0], blocks) && ok;
 }
 
-static inline bool do_rt(int argc, char *argv[])
+typedef struct {
+    mpmc_t *q;
+    int pairs;
+} mpmc_bench_t;
+
+/* Alternate insertions and removals, the usual pairs benchmark */
+static void *mpmc_bench_worker(void *arg)
 {
-    return do_remove(1, argc, argv);
+    mpmc_bench_t *b = arg;
+    for (int i = 0; i < b->pairs; i++) {
+        while (!mpmc_insert_tail(b->q, "mpmc"))
+            sched_yield();
+        char *s = mpmc_remove_head(b->q);
+        test_free(s);
+    }
+    return NULL;
 }
 
-/* remove head quietly */
-static bool do_rhq(int argc, char *argv[])
+static bool do_mpmcbench(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
         return false;
     }
 
-    bool ok = true;
-    if (!l_meta.size)
-        report(3, "Warning: Calling remove head on empty queue");
-    error_check();
-
-    element_t *re = NULL;
-
-    if (exception_setup(true))
-        re = q_remove_head(l_meta.l, NULL, 0);
-    exception_cancel();
+    int n;
+    if (!get_int(argv[1], &n) || n < 1) {
+        report(1, "Invalid number of pairs '%s'", argv[1]);
+        return false;
+    }
 
-    if (re) {
-        // q_remove_head and q_remove_tail are not responsible for releasing
-        // node
-        q_release_element(re);
+    size_t blocks = allocation_check();
+    bool ok = true;
+    for (int t = 1; ok && t <= 16; t <<= 1) {
+        mpmc_bench_t b = {.q = mpmc_new(), .pairs = n / t};
+        if (!b.q) {
+            report(1, "INTERNAL ERROR.  Could not allocate queue");
+            return false;
+        }
 
-        report(2, "Removed element from queue");
-        lcnt--;
-        l_meta.size--;
-    } else {
-        fail_count++;
-        if (fail_count < fail_limit)
-            report(2, "Removal failed");
-        else {
-            report(1, "ERROR: Removal failed (%d failures total)", fail_count);
-            ok = false;
+        pthread_t tid[16];
+        int started = 0;
+        double start_time;
+        init_time(&start_time);
+        for (; started < t; started++) {
+            if (pthread_create(&tid[started], NULL, mpmc_bench_worker, &b)) {
+                report(1, "ERROR: Could not create worker thread");
+                ok = false;
+                break;
+            }
         }
+        for (int i = 0; i < started; i++)
+            pthread_join(tid[i], NULL);
+        double elapsed = delta_time(&start_time);
+
+        if (ok)
+            report(1, "%2d threads: %d pairs in %.3f seconds (%.0f ops/sec)",
+                   t, b.pairs * t, elapsed,
+                   elapsed > 0 ? 2.0 * b.pairs * t / elapsed : 0.0);
+        mpmc_free(b.q);
+        mpmc_reclaim();
     }
-
-    show_queue(3);
-    return ok && !error_check();
+    return check_blocks(argv[0], blocks) && ok;
 }
 
 static bool do_dedup(int argc, char *argv[])
@@ -597,6 +2092,390 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Shared state of the blocking queue benchmark */
+typedef struct {
+    bq_t *q;
+    int n; /* Strings inserted by each producer */
+    size_t takes;
+    size_t received;
+} bq_bench_t;
+
+typedef struct {
+    bq_bench_t *b;
+    double *lat; /* Latencies seen by a consumer, in microseconds */
+    size_t nlat, cap;
+} bq_worker_t;
+
+/* Strings carried through the benchmark stamp their insertion time */
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void *bq_producer(void *arg)
+{
+    bq_worker_t *w = arg;
+    char buf[32];
+    for (int i = 0; i < w->b->n; i++) {
+        snprintf(buf, sizeof(buf), "%.3f", now_us());
+        if (!bq_insert_tail(w->b->q, buf, -1))
+            break;
+    }
+    return NULL;
+}
+
+#define BQ_TAKE 64
+
+/* Time the consumers get to take every string before the queue is closed */
+#define BQ_DRAIN_US 1000000
+
+static void *bq_consumer(void *arg)
+{
+    bq_worker_t *w = arg;
+    bq_bench_t *b = w->b;
+    element_t *out[BQ_TAKE];
+
+    /* Waiting without a timeout, nothing is taken only once q is closed */
+    size_t cnt;
+    while ((cnt = bq_remove_head_n(b->q, out, BQ_TAKE, -1))) {
+        __atomic_fetch_add(&b->takes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&b->received, cnt, __ATOMIC_RELAXED);
+
+        double t = now_us();
+        if (w->nlat + cnt > w->cap) {
+            size_t cap = w->cap ? w->cap * 2 : 1024;
+            while (cap < w->nlat + cnt)
+                cap *= 2;
+            double *lat = realloc(w->lat, cap * sizeof(double));
+            if (lat) {
+                w->lat = lat;
+                w->cap = cap;
+            }
+        }
+        for (size_t i = 0; i < cnt && w->nlat < w->cap; i++)
+            w->lat[w->nlat++] = t - atof(out[i]->value);
+        bq_release_elements(out, cnt);
+    }
+    return NULL;
+}
+
+static int double_cmp(const void *x, const void *y)
+{
+    double a = *(const double *) x, b = *(const double *) y;
+    return a < b ? -1 : a > b;
+}
+
+static bool do_bqbench(int argc, char *argv[])
+{
+    if (argc < 4 || argc > 6) {
+        report(1, "%s needs 3-5 arguments", argv[0]);
+        return false;
+    }
+
+    int p, c, n, cap = 1024, batch = 16;
+    if (!get_int(argv[1], &p) || !get_int(argv[2], &c) || p < 1 || c < 1 ||
+        p + c > MAX_THREADS) {
+        report(1, "Invalid number of threads '%s' '%s'", argv[1], argv[2]);
+        return false;
+    }
+    if (!get_int(argv[3], &n) || n < 1) {
+        report(1, "Invalid number of insertions '%s'", argv[3]);
+        return false;
+    }
+    if ((argc > 4 && (!get_int(argv[4], &cap) || cap < 1)) ||
+        (argc > 5 && (!get_int(argv[5], &batch) || batch < 1))) {
+        report(1, "Invalid capacity or batch size");
+        return false;
+    }
+
+    size_t blocks = allocation_check();
+    bq_bench_t b = {.q = bq_new(cap, batch), .n = n};
+    if (!b.q) {
+        report(1, "INTERNAL ERROR.  Could not allocate queue");
+        return false;
+    }
+
+    pthread_t tid[MAX_THREADS];
+    bq_worker_t w[MAX_THREADS];
+    memset(w, 0, sizeof(w));
+    int started = 0;
+    bool ok = true;
+
+    double start_time;
+    init_time(&start_time);
+    for (; ok && started < p + c; started++) {
+        w[started].b = &b;
+        if (pthread_create(&tid[started], NULL,
+                           started < c ? bq_consumer : bq_producer,
+                           &w[started])) {
+            report(1, "ERROR: Could not create worker thread");
+            ok = false;
+            break;
+        }
+    }
+    /*
+     * Producers run to completion, then the consumers must take what is
+     * left by themselves, even less than a batch, before q is closed.
+     */
+    for (int i = c; i < started; i++)
+        pthread_join(tid[i], NULL);
+    if (ok) {
+        size_t want = (size_t) p * n;
+        for (int waited = 0;
+             __atomic_load_n(&b.received, __ATOMIC_RELAXED) < want &&
+             waited < BQ_DRAIN_US;
+             waited += 1000)
+            usleep(1000);
+        size_t got = __atomic_load_n(&b.received, __ATOMIC_RELAXED);
+        if (got < want) {
+            report(1, "ERROR: Consumers left %lu strings waiting", want - got);
+            ok = false;
+        }
+    }
+    bq_close(b.q);
+    for (int i = 0; i < c && i < started; i++)
+        pthread_join(tid[i], NULL);
+    double elapsed = delta_time(&start_time);
+
+    size_t total = 0;
+    for (int i = 0; i < c && i < started; i++)
+        total += w[i].nlat;
+    double *lat = malloc((total ? total : 1) * sizeof(double));
+    if (lat) {
+        size_t k = 0;
+        for (int i = 0; i < c && i < started; i++) {
+            memcpy(lat + k, w[i].lat, w[i].nlat * sizeof(double));
+            k += w[i].nlat;
+        }
+        qsort(lat, total, sizeof(double), double_cmp);
+    }
+
+    if (ok && total != (size_t) p * n) {
+        report(1, "ERROR: Received %lu strings, but expected %lu", total,
+               (size_t) p * n);
+        ok = false;
+    } else if (ok) {
+        report(1,
+               "%d producers, %d consumers, capacity %d, batch %d: %lu "
+               "strings in %.3f seconds (%.0f strings/sec)",
+               p, c, cap, batch, total, elapsed,
+               elapsed > 0 ? total / elapsed : 0.0);
+        if (lat && total)
+            report(1,
+                   "Latency p50 %.1f us, p99 %.1f us, max %.1f us; %.1f "
+                   "strings per take, %lu wakeups",
+                   lat[total / 2], lat[total * 99 / 100], lat[total - 1],
+                   (double) total / b.takes, bq_wakeups(b.q));
+    }
+
+    free(lat);
+    for (int i = 0; i < started; i++)
+        free(w[i].lat);
+    bq_free(b.q);
+    return check_blocks(argv[0], blocks) && ok;
+}
+
+/* Ensure the first cnt elements of queue are in ascending order */
+static bool check_sorted(int cnt)
+{
+    if (!l_meta.size)
+        return true;
+
+    for (struct list_head *cur_l = l_meta.l->next;
+         cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
+        /* FIXME: add an option to specify sorting order */
+        element_t *item, *next_item;
+        item = list_entry(cur_l, element_t, list);
+        next_item = list_entry(cur_l->next, element_t, list);
+        if (strcasecmp(item->value, next_item->value) > 0) {
+            report(1, "ERROR: Not sorted in ascending order");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Below this many elements, a sort task sorts on its own */
+#define PSORT_CUTOFF 2048
+
+typedef struct {
+    ws_task_t task;
+    element_t **a, **tmp;
+    size_t n;
+} psort_task_t;
+
+static int element_cmp(const void *x, const void *y)
+{
+    return strcasecmp((*(element_t *const *) x)->value,
+                      (*(element_t *const *) y)->value);
+}
+
+/* Merge sort forking the left half, with the right half sorted in place */
+static void psort_run(ws_task_t *t)
+{
+    psort_task_t *st = container_of(t, psort_task_t, task);
+    if (st->n <= PSORT_CUTOFF) {
+        qsort(st->a, st->n, sizeof(element_t *), element_cmp);
+        return;
+    }
+
+    size_t half = st->n / 2;
+    psort_task_t left = {.task.fn = psort_run, .a = st->a, .tmp = st->tmp,
+                         .n = half};
+    psort_task_t right = {.task.fn = psort_run, .a = st->a + half,
+                          .tmp = st->tmp + half, .n = st->n - half};
+    ws_fork(&left.task);
+    psort_run(&right.task);
+    ws_join(&left.task);
+
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < st->n)
+        st->tmp[k++] = element_cmp(&st->a[j], &st->a[i]) < 0 ? st->a[j++]
+                                                              : st->a[i++];
+    while (i < half)
+        st->tmp[k++] = st->a[i++];
+    while (j < st->n)
+        st->tmp[k++] = st->a[j++];
+    memcpy(st->a, st->tmp, st->n * sizeof(element_t *));
+}
+
+/* sort queue with a work-stealing pool */
+static bool do_psort(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int t = 4;
+    if (argc == 2 && (!get_int(argv[1], &t) || t < 1 || t > MAX_THREADS)) {
+        report(1, "Invalid number of threads '%s'", argv[1]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling sort on null queue");
+    error_check();
+
+    int cnt = q_size(l_meta.l);
+    if (cnt < 2) {
+        report(3, "Warning: Calling sort on single node");
+        show_queue(3);
+        return !error_check();
+    }
+
+    size_t blocks = allocation_check();
+    element_t **a = malloc(2 * cnt * sizeof(element_t *));
+    ws_pool_t *pool = ws_pool_new(t);
+    if (!a || !pool) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for sorting");
+        free(a);
+        ws_pool_free(pool);
+        return false;
+    }
+
+    size_t n = 0;
+    element_t *item;
+    list_for_each_entry (item, l_meta.l, list)
+        a[n++] = item;
+
+    double start_time;
+    init_time(&start_time);
+    psort_task_t root = {.task.fn = psort_run, .a = a, .tmp = a + n, .n = n};
+    ws_pool_run(pool, &root.task);
+    double elapsed = delta_time(&start_time);
+
+    INIT_LIST_HEAD(l_meta.l);
+    for (size_t i = 0; i < n; i++)
+        list_add_tail(&a[i]->list, l_meta.l);
+    report(3, "Sorted %lu elements with %d threads in %.3f seconds", n, t,
+           elapsed);
+
+    ws_pool_free(pool);
+    free(a);
+
+    bool ok = check_blocks(argv[0], blocks) && check_sorted(cnt);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+typedef struct {
+    ws_task_t task;
+    int n, cutoff;
+    long result;
+} fib_task_t;
+
+static long fib_serial(int n)
+{
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+static void fib_run(ws_task_t *t)
+{
+    fib_task_t *f = container_of(t, fib_task_t, task);
+    if (f->n < f->cutoff) {
+        f->result = fib_serial(f->n);
+        return;
+    }
+
+    fib_task_t a = {.task.fn = fib_run, .n = f->n - 1, .cutoff = f->cutoff};
+    fib_task_t b = {.task.fn = fib_run, .n = f->n - 2, .cutoff = f->cutoff};
+    ws_fork(&a.task);
+    fib_run(&b.task);
+    ws_join(&a.task);
+    f->result = a.result + b.result;
+}
+
+/* Time recursive fork/join Fibonacci against the serial version */
+static bool do_fjbench(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int n, cutoff = 10;
+    if (!get_int(argv[1], &n) || n < 0 || n > 45) {
+        report(1, "Invalid Fibonacci number '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &cutoff) || cutoff < 2)) {
+        report(1, "Invalid cutoff '%s'", argv[2]);
+        return false;
+    }
+
+    double start_time;
+    init_time(&start_time);
+    long expect = fib_serial(n);
+    double serial = delta_time(&start_time);
+    report(1, "fib(%d) = %ld, serial in %.3f seconds", n, expect, serial);
+
+    size_t blocks = allocation_check();
+    for (int t = 1; t <= 8; t <<= 1) {
+        ws_pool_t *pool = ws_pool_new(t);
+        if (!pool) {
+            report(1, "ERROR: Could not start a pool of %d threads", t);
+            return false;
+        }
+
+        fib_task_t root = {.task.fn = fib_run, .n = n, .cutoff = cutoff};
+        init_time(&start_time);
+        ws_pool_run(pool, &root.task);
+        double elapsed = delta_time(&start_time);
+        ws_pool_free(pool);
+
+        if (root.result != expect) {
+            report(1, "ERROR: %d threads computed %ld", t, root.result);
+            return false;
+        }
+        report(1, "%d threads: %.3f seconds (%.2fx serial)", t, elapsed,
+               elapsed > 0 ? serial / elapsed : 0.0);
+    }
+    return check_blocks(argv[0], blocks);
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -619,23 +2498,7 @@ bool do_sort(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    bool ok = true;
-    if (l_meta.size) {
-        for (struct list_head *cur_l = l_meta.l->next;
-             cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
-            /* Ensure each element in ascending order */
-            /* FIXME: add an option to specify sorting order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (strcasecmp(item->value, next_item->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
-                ok = false;
-                break;
-            }
-        }
-    }
-
+    bool ok = check_sorted(cnt);
     show_queue(3);
     return ok && !error_check();
 }
@@ -768,23 +2631,30 @@ static void console_init()
     ADD_COMMAND(free, "                | Delete queue");
     ADD_COMMAND(
         ih,
-        " str [n]        | Insert string str at head of queue n times. "
-        "Generate random string(s) if str equals RAND. (default: n == 1)");
+        " [-m] str [n]   | Insert string str at head of queue n times. "
+        "Generate random string(s) if str equals RAND, or Zipf-distributed "
+        "ones if str equals ZIPF. (default: n == 1) "
+        "With -m, hand a heap copy over to the queue without copying");
     ADD_COMMAND(
         it,
-        " str [n]        | Insert string str at tail of queue n times. "
-        "Generate random string(s) if str equals RAND. (default: n == 1)");
+        " [-m] str [n]   | Insert string str at tail of queue n times. "
+        "Generate random string(s) if str equals RAND, or Zipf-distributed "
+        "ones if str equals ZIPF. (default: n == 1) "
+        "With -m, hand a heap copy over to the queue without copying");
     ADD_COMMAND(
         rh,
-        " [str]          | Remove from head of queue.  Optionally compare "
-        "to expected value str");
+        " [-m] [str]     | Remove from head of queue.  Optionally compare "
+        "to expected value str.  With -m, take the string back");
     ADD_COMMAND(
         rt,
-        " [str]          | Remove from tail of queue.  Optionally compare "
-        "to expected value str");
+        " [-m] [str]     | Remove from tail of queue.  Optionally compare "
+        "to expected value str.  With -m, take the string back");
     ADD_COMMAND(
         rhq,
         "                | Remove from head of queue without reporting value.");
+    ADD_COMMAND(rhn,
+                " n              | Remove n elements from head of queue in one "
+                "batch");
     ADD_COMMAND(reverse, "                | Reverse queue");
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
     ADD_COMMAND(
@@ -795,12 +2665,101 @@ static void console_init()
         dedup, "                | Delete all nodes that have duplicate string");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
+    ADD_COMMAND(pool,
+                "                | Show memory used by the string interning "
+                "pool");
+    ADD_COMMAND(find,
+                " str [n]        | Look up str in queue n times (default: "
+                "n == 1)");
+    ADD_COMMAND(rv, " str            | Remove an element equal to str");
+    ADD_COMMAND(index,
+                " [0|1]          | Drop or build the hash index of queue, "
+                "and show its memory overhead");
+    ADD_COMMAND(lru,
+                " [n]            | Create a LRU cache of n strings (drop it if "
+                "n == 0), or show its statistics");
+    ADD_COMMAND(lget, " key            | Look up key in LRU cache");
+    ADD_COMMAND(lput,
+                " key            | Insert or refresh key in LRU cache");
+    ADD_COMMAND(levict,
+                "                | Evict least recently used string from "
+                "cache");
+    ADD_COMMAND(lbench,
+                " n              | Replay n Zipf-distributed accesses against "
+                "LRU cache");
+    ADD_COMMAND(pqins,
+                " str [n]        | Insert string str into priority queue n "
+                "times. Generate random string(s) if str equals RAND, or "
+                "Zipf-distributed ones if str equals ZIPF. (default: n == 1)");
+    ADD_COMMAND(pqpeek,
+                " [str]          | Show smallest string in priority queue.  "
+                "Optionally compare to expected value str");
+    ADD_COMMAND(pqpop,
+                " [str]          | Remove smallest string from priority queue. "
+                " Optionally compare to expected value str");
+    ADD_COMMAND(pqbench,
+                " n [b]          | Compare priority queue against insert+sort "
+                "on n random keys inserted in batches of b");
+    ADD_COMMAND(dq,
+                " str d [n]      | Insert string str at tail of queue n times "
+                "once d ticks have passed. Generate random string(s) if str "
+                "equals RAND, or Zipf-distributed ones if str equals ZIPF. "
+                "(default: n == 1)");
+    ADD_COMMAND(dcancel, " id             | Cancel delayed insertion id");
+    ADD_COMMAND(tick,
+                " [n]            | Advance the clock of delayed insertions n "
+                "ticks (default: n == 1)");
+    ADD_COMMAND(mpmc,
+                " n [t]          | Stress the lock-free queue with t producers "
+                "and t consumers passing n strings each (default: t == 4)");
+    ADD_COMMAND(mpmcbench,
+                " n              | Time n insert/remove pairs on the lock-free "
+                "queue with 1 to 16 threads");
+    ADD_COMMAND(bqbench,
+                " p c n [s] [b]  | Pass n strings from each of p producers to "
+                "c consumers through a blocking queue of capacity s, whose "
+                "consumers wait briefly for b strings (default: s == 1024, "
+                "b == 16)");
+    ADD_COMMAND(psort,
+                " [t]            | Sort queue with a pool of t work-stealing "
+                "threads (default: t == 4)");
+    ADD_COMMAND(fjbench,
+                " n [c]          | Time fork/join Fibonacci of n, serial below "
+                "c (default: c == 10), on 1 to 8 work-stealing threads");
+    ADD_COMMAND(budget,
+                "                | Show how much of the time budget timed "
+                "operations used");
+    ADD_COMMAND(memstats,
+                "                | Show allocation sizes, live and peak bytes, "
+                "and allocations made by each command");
+    ADD_COMMAND(fault,
+                " [nth n|op i..] | Fail the nth allocation from now, or "
+                "allocations i.. of every operation; off cancels every "
+                "failure. Show the fault schedule");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("intern", &intern_mode,
+              "Share duplicate strings through an interning pool",
+              intern_changed);
+    add_param("seed", &seed, "Reseed random strings and malloc failures",
+              seed_changed);
+    add_param("budget", &time_budget,
+              "Time budget of each operation in microseconds (0: untimed)",
+              budget_changed);
+    add_param("batch", &batch,
+              "Time operations against one periodic timer, without system "
+              "calls",
+              batch_changed);
+    add_param("check", &check_level,
+              "Harness checking level (0 canary, 1 sampled, 2 full)",
+              check_changed);
+    add_param("sample", &check_sample,
+              "Poison one in this many blocks at the sampled level",
+              sample_changed);
 }
 
 /* Signal handlers */
@@ -815,6 +2774,9 @@ static void sigsegvhandler(int sig)
 
 static void sigalrmhandler(int sig)
 {
+    /* In batch mode, the timer ticks and the budget may not be over yet */
+    if (!budget_expired())
+        return;
     trigger_exception(
         "Time limit exceeded.  Either you are in an infinite loop, or your "
         "code is too inefficient");
@@ -826,18 +2788,42 @@ static void queue_init()
     l_meta.l = NULL;
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
+    tw_init(&delay_queue);
 }
 
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
+    if (zipf_cdf)
+        free_array(zipf_cdf, ZIPF_WORDS, sizeof(double));
+
+    if (exception_setup(true))
+        lru_free(lru_cache);
+    exception_cancel();
+    lru_cache = NULL;
+
+    if (exception_setup(true))
+        pq_free(&prio_queue);
+    exception_cancel();
+
+    if (exception_setup(true))
+        tw_clear(&delay_queue);
+    exception_cancel();
 
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
+
+    if (memdump_name) {
+        FILE *f = fopen(memdump_name, "w");
+        if (f) {
+            memdump(f);
+            fclose(f);
+        } else {
+            report(1, "ERROR: Could not write allocation profile to %s",
+                   memdump_name);
+        }
+    }
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -851,11 +2837,22 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-g] [-n] [-p] [-f IFILE][-s SOCK][-v VLEVEL][-l "
+        "LFILE][-m MFILE]\n"
+        "       %s --compile IFILE OFILE\n",
+        cmd, cmd);
     printf("\t-h         Print this information\n");
+    printf("\t-g         Place blocks against guard pages\n");
+    printf("\t-n         Do not enforce time budgets\n");
+    printf("\t-p         Read and split lines of IFILE while running others\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-s SOCK    Serve commands to clients of Unix socket SOCK\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-m MFILE   Dump allocation profile to MFILE as JSON at exit\n");
+    printf("\t--compile  Compile the commands in IFILE into bytecode in OFILE,\n"
+           "\t           which -f replays faster than text\n");
     exit(0);
 }
 
@@ -904,19 +2901,45 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char mbuf[BUFSIZE];
+    char sbuf[BUFSIZE];
+    char *server_name = NULL;
     int level = 4;
+    bool compile = false;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    static const struct option long_opts[] = {
+        {"compile", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    while ((c = getopt_long(argc, argv, "hgnpv:f:s:l:m:", long_opts, NULL)) !=
+           -1) {
         switch (c) {
+        case 'c':
+            compile = true;
+            break;
         case 'h':
             usage(argv[0]);
             break;
+        case 'g':
+            set_guard_mode(true);
+            break;
+        case 'n':
+            set_budget_mode(false);
+            break;
+        case 'p':
+            set_pipeline_mode(true);
+            break;
         case 'f':
             strncpy(buf, optarg, BUFSIZE);
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 's':
+            strncpy(sbuf, optarg, BUFSIZE);
+            sbuf[BUFSIZE - 1] = '\0';
+            server_name = sbuf;
+            break;
         case 'v': {
             char *endptr;
             errno = 0;
@@ -932,6 +2955,11 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'm':
+            strncpy(mbuf, optarg, BUFSIZE);
+            mbuf[BUFSIZE - 1] = '\0';
+            memdump_name = mbuf;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -939,6 +2967,7 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* Vary random strings between runs, but not which mallocs fail */
     srand((unsigned int) (time(NULL)));
     queue_init();
     init_cmd();
@@ -950,16 +2979,31 @@ int main(int argc, char *argv[])
     linenoiseHistorySetMaxLen(HISTORY_LEN);
     linenoiseHistoryLoad(HISTORY_FILE); /* Load the history at startup */
     set_verblevel(level);
+    if (compile) {
+        if (argc - optind != 2)
+            usage(argv[0]);
+        return compile_file(argv[optind], argv[optind + 1]) ? 0 : 1;
+    }
     if (level > 1) {
         set_echo(true);
     }
     if (logfile_name)
         set_logfile(logfile_name);
 
+    /* Commands from a file come in bulk, so make them cheap to guard */
+    if (infile_name) {
+        batch = 1;
+        set_batch_mode(true);
+    }
+
     add_quit_helper(queue_quit);
+    set_cmd_hook(profile_hook);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (server_name)
+        ok = ok && run_server(server_name);
+    else
+        ok = ok && run_console(infile_name);
     ok = ok && finish_cmd();
 
     return ok ? 0 : 1;
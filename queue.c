@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "harness.h"
+#include "intern.h"
 #include "queue.h"
 
 #include <stdint.h>
@@ -15,36 +16,225 @@
  *   cppcheck-suppress nullPointer
  */
 
+/* Initial number of buckets of the hash index, must be a power of 2 */
+#define INDEX_MIN_BUCKETS 64
+
+/*
+ * Queue head together with its optional hash index.
+ * The head must stay in first position, since callers only ever see a
+ * pointer to it.
+ */
+typedef struct {
+    struct list_head head;
+    struct hlist_head *buckets; /* NULL while the index is off */
+    size_t nbuckets;
+    size_t nindexed;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/*
+ * Chain of the hash index.  It lives outside element_t, so that elements
+ * of queues which are never indexed do not pay for it.
+ */
+typedef struct {
+    element_t *elem;
+    struct hlist_node hnode;
+} index_node_t;
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
  */
 struct list_head *q_new()
 {
-    struct list_head *head =
-        (struct list_head *) malloc(sizeof(struct list_head));
-    if (head == NULL)
+    queue_t *q = malloc(sizeof(queue_t));
+    if (q == NULL)
         return NULL;
     else {
-        head->prev = head;
-        head->next = head;
-        return head;
+        INIT_LIST_HEAD(&q->head);
+        q->buckets = NULL;
+        q->nbuckets = 0;
+        q->nindexed = 0;
+        return &q->head;
+    }
+}
+
+/* Share equal strings through the interning pool? */
+static bool intern_mode = false;
+
+/*
+ * Enable or disable string interning for newly inserted elements.
+ * Elements inserted before keep whatever string they already have.
+ */
+void q_set_intern(bool enable)
+{
+    intern_mode = enable;
+}
+
+/*
+ * Allocate the string of a new element. len includes the null terminator.
+ * The string is interned exactly when intern_mode is set.
+ */
+static char *value_new(const char *s, size_t len)
+{
+    if (intern_mode)
+        return intern_get(s);
+
+    char *str = malloc(len);
+    return str ? memcpy(str, s, len) : NULL;
+}
+
+/* Release the string of an element, with no lookup unless it is interned */
+static void value_free(char *s, bool interned)
+{
+    if (interned)
+        intern_put(s);
+    else
+        free(s);
+}
+
+/*
+ * Return a string equal to the one of an element that the caller may free.
+ * Interned strings are shared, so hand out a private copy instead, and
+ * leave releasing the original to the caller.
+ * Return NULL if could not allocate space.
+ */
+static char *value_own(element_t *e)
+{
+    return e->interned ? strdup(e->value) : e->value;
+}
+
+/* Equality of element strings: pointer compare suffices for interned ones */
+static inline bool value_equal(const char *a, const char *b)
+{
+    return a == b || strcmp(a, b) == 0;
+}
+
+static inline struct hlist_head *index_bucket(queue_t *q, const char *s)
+{
+    size_t len;
+    return &q->buckets[intern_hash(s, &len) & (q->nbuckets - 1)];
+}
+
+/* Rehash into twice as many buckets, keeping the old ones on failure */
+static void index_grow(queue_t *q)
+{
+    size_t n = q->nbuckets << 1;
+    struct hlist_head *old = q->buckets;
+    struct hlist_head *nb = malloc(n * sizeof(struct hlist_head));
+    if (nb == NULL)
+        return;
+    for (size_t i = 0; i < n; i++)
+        INIT_HLIST_HEAD(&nb[i]);
+
+    q->buckets = nb;
+    q->nbuckets = n;
+    for (size_t i = 0; i < n >> 1; i++) {
+        struct hlist_node *node, *safe;
+        hlist_for_each_safe (node, safe, &old[i]) {
+            index_node_t *in = hlist_entry(node, index_node_t, hnode);
+            hlist_add_head(node, index_bucket(q, in->elem->value));
+        }
+    }
+    free(old);
+}
+
+/*
+ * Track an element that is about to be linked into queue.
+ * Return false if could not allocate space for it.
+ */
+static bool index_add(struct list_head *head, element_t *e)
+{
+    queue_t *q = to_queue(head);
+    if (q->buckets == NULL)
+        return true;
+
+    index_node_t *in = malloc(sizeof(index_node_t));
+    if (in == NULL)
+        return false;
+    if (q->nindexed >= q->nbuckets)
+        index_grow(q);
+    in->elem = e;
+    hlist_add_head(&in->hnode, index_bucket(q, e->value));
+    q->nindexed++;
+    return true;
+}
+
+/* Forget an element that is being unlinked from queue */
+static void index_del(struct list_head *head, element_t *e)
+{
+    queue_t *q = to_queue(head);
+    if (q->buckets == NULL)
+        return;
+
+    index_node_t *in;
+    hlist_for_each_entry (in, index_bucket(q, e->value), hnode) {
+        if (in->elem == e) {
+            hlist_del(&in->hnode);
+            free(in);
+            q->nindexed--;
+            return;
+        }
+    }
+}
+
+/*
+ * Track every element of chain, which is about to be spliced into queue.
+ * Return false, tracking none of them, if could not allocate space.
+ */
+static bool index_add_chain(struct list_head *head, struct list_head *chain)
+{
+    struct list_head *node;
+    if (to_queue(head)->buckets == NULL)
+        return true;
+    list_for_each (node, chain) {
+        if (!index_add(head, list_entry(node, element_t, list))) {
+            while ((node = node->prev) != chain)
+                index_del(head, list_entry(node, element_t, list));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Drop the hash index of queue, if any */
+static void index_clear(queue_t *q)
+{
+    for (size_t i = 0; i < q->nbuckets; i++) {
+        struct hlist_node *node, *safe;
+        hlist_for_each_safe (node, safe, &q->buckets[i])
+            free(hlist_entry(node, index_node_t, hnode));
+    }
+    free(q->buckets);
+    q->buckets = NULL;
+    q->nbuckets = 0;
+    q->nindexed = 0;
+}
+
+/* Free every element chained on l, but not l itself */
+static void q_free_chain(struct list_head *l)
+{
+    struct list_head *cur = l->next;
+    while (cur != l) {
+        element_t *e = list_entry(cur, element_t, list);
+        cur = cur->next;
+        value_free(e->value, e->interned);
+        free(e);
     }
+    INIT_LIST_HEAD(l);
 }
 
 /* Free all storage used by queue */
 void q_free(struct list_head *l)
 {
-    struct list_head *cur;
     if (l != NULL) {
-        cur = l->next;
-        while (cur != l) {
-            element_t *e = list_entry(cur, element_t, list);
-            cur = cur->next;
-            free(e->value);
-            free(e);
-        }
-        free(l);
+        index_clear(to_queue(l));
+        q_free_chain(l);
+        free(to_queue(l));
     }
 }
 
@@ -59,16 +249,21 @@ bool q_insert_head(struct list_head *head, char *s)
 {
     int str_len = strlen(s) + 1;
     element_t *node = malloc(sizeof(element_t));
-    char *str = malloc(sizeof(char) * str_len);
+    char *str = value_new(s, str_len);
     if (node == NULL || head == NULL || str == NULL) {
         if (node)
             free(node);
         if (str)
-            free(str);
+            value_free(str, intern_mode);
         return false;
     } else {
-        strncpy(str, s, str_len);
         node->value = str;
+        node->interned = intern_mode;
+        if (!index_add(head, node)) {
+            free(node);
+            value_free(str, intern_mode);
+            return false;
+        }
         node->list.prev = head;
         node->list.next = head->next;
         head->next->prev = &node->list;
@@ -88,16 +283,21 @@ bool q_insert_tail(struct list_head *head, char *s)
 {
     int str_len = strlen(s) + 1;
     element_t *node = malloc(sizeof(element_t));
-    char *str = malloc(sizeof(char) * str_len);
+    char *str = value_new(s, str_len);
     if (node == NULL || head == NULL || str == NULL) {
         if (node)
             free(node);
         if (str)
-            free(str);
+            value_free(str, intern_mode);
         return false;
     } else {
-        strncpy(str, s, str_len);
         node->value = str;
+        node->interned = intern_mode;
+        if (!index_add(head, node)) {
+            free(node);
+            value_free(str, intern_mode);
+            return false;
+        }
         node->list.prev = head->prev;
         node->list.next = head;
         head->prev->next = &node->list;
@@ -106,6 +306,187 @@ bool q_insert_tail(struct list_head *head, char *s)
     }
 }
 
+/*
+ * Attempt to insert element at head of queue without copying the string.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ * On success the queue takes ownership of s, otherwise the caller keeps it.
+ */
+bool q_insert_head_owned(struct list_head *head, char *s)
+{
+    if (head == NULL || s == NULL)
+        return false;
+
+    element_t *node = malloc(sizeof(element_t));
+    if (node == NULL)
+        return false;
+
+    node->value = s;
+    node->interned = false;
+    if (!index_add(head, node)) {
+        free(node);
+        return false;
+    }
+    list_add(&node->list, head);
+    return true;
+}
+
+/*
+ * Attempt to insert element at tail of queue without copying the string.
+ * Other attribute is as same as q_insert_head_owned.
+ */
+bool q_insert_tail_owned(struct list_head *head, char *s)
+{
+    if (head == NULL || s == NULL)
+        return false;
+
+    element_t *node = malloc(sizeof(element_t));
+    if (node == NULL)
+        return false;
+
+    node->value = s;
+    node->interned = false;
+    if (!index_add(head, node)) {
+        free(node);
+        return false;
+    }
+    list_add_tail(&node->list, head);
+    return true;
+}
+
+/*
+ * Allocate n elements off-list and chain them on chain.
+ * Strings come from strs[i] when strs is non-NULL, otherwise every element
+ * gets a copy of s. When reverse is set, the chain is built in reverse order
+ * so that splicing it at the head matches n calls of q_insert_head.
+ * On failure everything allocated so far is released and false is returned.
+ */
+static bool build_chain(struct list_head *chain,
+                        const char *const *strs,
+                        const char *s,
+                        size_t n,
+                        bool reverse)
+{
+    size_t len = strs ? 0 : strlen(s) + 1;
+    char *shared = NULL;
+
+    INIT_LIST_HEAD(chain);
+    for (size_t i = 0; i < n; i++) {
+        const char *src = strs ? strs[i] : s;
+        if (strs)
+            len = strlen(src) + 1;
+
+        element_t *node = malloc(sizeof(element_t));
+        char *str;
+        if (intern_mode && !strs) {
+            /* Look the repeated string up once, then just take references */
+            str = shared ? intern_dup(shared) : (shared = intern_get(s));
+        } else {
+            str = value_new(src, len);
+        }
+        if (node == NULL || str == NULL) {
+            free(node);
+            if (str)
+                value_free(str, intern_mode);
+            q_free_chain(chain);
+            return false;
+        }
+        node->value = str;
+        node->interned = intern_mode;
+        if (reverse)
+            list_add(&node->list, chain);
+        else
+            list_add_tail(&node->list, chain);
+    }
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at head of queue in one batch.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case the
+ * queue is left untouched.
+ */
+bool q_insert_head_n(struct list_head *head,
+                     const char *const *strs,
+                     size_t n)
+{
+    LIST_HEAD(chain);
+    if (head == NULL || (n && strs == NULL))
+        return false;
+    if (!build_chain(&chain, strs, NULL, n, true))
+        return false;
+    if (!index_add_chain(head, &chain)) {
+        q_free_chain(&chain);
+        return false;
+    }
+
+    list_splice(&chain, head);
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at tail of queue in one batch.
+ * Other attribute is as same as q_insert_head_n.
+ */
+bool q_insert_tail_n(struct list_head *head,
+                     const char *const *strs,
+                     size_t n)
+{
+    LIST_HEAD(chain);
+    if (head == NULL || (n && strs == NULL))
+        return false;
+    if (!build_chain(&chain, strs, NULL, n, false))
+        return false;
+    if (!index_add_chain(head, &chain)) {
+        q_free_chain(&chain);
+        return false;
+    }
+
+    list_splice_tail(&chain, head);
+    return true;
+}
+
+/*
+ * Attempt to insert n copies of string s at head of queue in one batch.
+ * Other attribute is as same as q_insert_head_n.
+ */
+bool q_insert_head_repeat(struct list_head *head, const char *s, size_t n)
+{
+    LIST_HEAD(chain);
+    if (head == NULL || s == NULL)
+        return false;
+    if (!build_chain(&chain, NULL, s, n, true))
+        return false;
+    if (!index_add_chain(head, &chain)) {
+        q_free_chain(&chain);
+        return false;
+    }
+
+    list_splice(&chain, head);
+    return true;
+}
+
+/*
+ * Attempt to insert n copies of string s at tail of queue in one batch.
+ * Other attribute is as same as q_insert_head_n.
+ */
+bool q_insert_tail_repeat(struct list_head *head, const char *s, size_t n)
+{
+    LIST_HEAD(chain);
+    if (head == NULL || s == NULL)
+        return false;
+    if (!build_chain(&chain, NULL, s, n, false))
+        return false;
+    if (!index_add_chain(head, &chain)) {
+        q_free_chain(&chain);
+        return false;
+    }
+
+    list_splice_tail(&chain, head);
+    return true;
+}
+
 /*
  * Attempt to remove element from head of queue.
  * Return target element.
@@ -126,6 +507,7 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
         element_t *e = list_first_entry(head, element_t, list);
         head->next = head->next->next;
         e->list.next->prev = head;
+        index_del(head, e);
         if (sp != NULL) {
             strncpy(sp, e->value, bufsize);
             sp[bufsize - 1] = '\0';
@@ -145,6 +527,7 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
         element_t *e = list_last_entry(head, element_t, list);
         head->prev = head->prev->prev;
         e->list.prev->next = head;
+        index_del(head, e);
         if (sp != NULL) {
             strncpy(sp, e->value, bufsize);
             sp[bufsize - 1] = '\0';
@@ -154,16 +537,93 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
     return NULL;
 }
 
+/*
+ * Attempt to remove element from head of queue and hand back its string.
+ * Return NULL if queue is NULL or empty.
+ * The element is freed, and the caller becomes the owner of the string.
+ */
+char *q_remove_head_owned(struct list_head *head)
+{
+    if (head == NULL || list_empty(head))
+        return NULL;
+
+    element_t *e = list_first_entry(head, element_t, list);
+    char *s = value_own(e);
+    if (s == NULL)
+        return NULL;
+    list_del(&e->list);
+    index_del(head, e);
+    if (s != e->value)
+        value_free(e->value, e->interned);
+    free(e);
+    return s;
+}
+
+/*
+ * Attempt to remove element from tail of queue and hand back its string.
+ * Other attribute is as same as q_remove_head_owned.
+ */
+char *q_remove_tail_owned(struct list_head *head)
+{
+    if (head == NULL || list_empty(head))
+        return NULL;
+
+    element_t *e = list_last_entry(head, element_t, list);
+    char *s = value_own(e);
+    if (s == NULL)
+        return NULL;
+    list_del(&e->list);
+    index_del(head, e);
+    if (s != e->value)
+        value_free(e->value, e->interned);
+    free(e);
+    return s;
+}
+
+/*
+ * Attempt to remove up to n elements from head of queue in one batch.
+ * Return the number of elements removed and store them in out[].
+ * The whole run is detached with a single list_cut_position.
+ */
+size_t q_remove_head_n(struct list_head *head, element_t **out, size_t n)
+{
+    if (head == NULL || out == NULL || n == 0 || list_empty(head))
+        return 0;
+
+    size_t cnt = 0;
+    struct list_head *last = head;
+    while (cnt < n && last->next != head) {
+        last = last->next;
+        out[cnt] = list_entry(last, element_t, list);
+        index_del(head, out[cnt++]);
+    }
+
+    LIST_HEAD(removed);
+    list_cut_position(&removed, head, last);
+    return cnt;
+}
+
 /*
  * WARN: This is for external usage, don't modify it
  * Attempt to release element.
  */
 void q_release_element(element_t *e)
 {
-    free(e->value);
+    value_free(e->value, e->interned);
     free(e);
 }
 
+/*
+ * Attempt to release n elements stored in array out.
+ */
+void q_release_elements(element_t **out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        value_free(out[i]->value, out[i]->interned);
+        free(out[i]);
+    }
+}
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
@@ -205,20 +665,22 @@ bool q_delete_mid(struct list_head *head)
             rear->prev->next = rear->next;
             front->next->prev = front->prev;
             element_t *e = list_entry(rear, element_t, list);
-            free(e->value);
+            index_del(head, e);
+            value_free(e->value, e->interned);
             free(e);
         } else if (rear == front->next) {
             rear->next->prev = front;
             front->next = rear->next;
             element_t *e = list_entry(rear, element_t, list);
-            free(e->value);
+            index_del(head, e);
+            value_free(e->value, e->interned);
             free(e);
         }
         return true;
     }
 }
 
-void _delete_node(struct list_head *node)
+static void _delete_node(struct list_head *head, struct list_head *node)
 {
     struct list_head *front = node->prev;
     struct list_head *rear = node->next;
@@ -226,7 +688,8 @@ void _delete_node(struct list_head *node)
     front->next = rear;
     rear->prev = front;
     element_t *e = list_entry(node, element_t, list);
-    free(e->value);
+    index_del(head, e);
+    value_free(e->value, e->interned);
     free(e);
     return;
 }
@@ -248,32 +711,131 @@ bool q_delete_dup(struct list_head *head)
         return false;
     else {
         struct list_head *cur = head->next;
-        char *target_str = NULL;
-        int str_len;
-        while (cur != head && cur->next != head) {
-            element_t *e1 = list_entry(cur, element_t, list);
-            element_t *e2 = list_entry(cur->next, element_t, list);
-            if (strcmp(e1->value, e2->value) == 0) {
-                str_len = strlen(e1->value) + 1;
-                target_str = malloc(sizeof(char) * str_len);
-                strncpy(target_str, e1->value, str_len);
-                while (cur != head && strcmp(target_str, e1->value) == 0) {
-                    cur = cur->next;
-                    _delete_node(cur->prev);
-                    if (cur == head)
-                        break;
-                    else
-                        e1 = list_entry(cur, element_t, list);
-                }
-                free(target_str);
-            } else {
-                cur = cur->next;
+        while (cur != head) {
+            /* The string of cur stays alive until cur itself is deleted */
+            char *target_str = list_entry(cur, element_t, list)->value;
+            struct list_head *next = cur->next;
+            bool dup = false;
+            while (next != head &&
+                   value_equal(target_str,
+                               list_entry(next, element_t, list)->value)) {
+                next = next->next;
+                _delete_node(head, next->prev);
+                dup = true;
             }
+            if (dup)
+                _delete_node(head, cur);
+            cur = next;
         }
         return true;
     }
 }
 
+/*
+ * Build or drop the hash index of queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space for the index.
+ */
+bool q_index_enable(struct list_head *head, bool enable)
+{
+    if (head == NULL)
+        return false;
+
+    queue_t *q = to_queue(head);
+    struct list_head *node;
+    if (!enable) {
+        index_clear(q);
+        return true;
+    }
+    if (q->buckets != NULL)
+        return true;
+
+    /* Size the table for the current contents right away */
+    size_t n = INDEX_MIN_BUCKETS;
+    list_for_each (node, head) {
+        if (q->nindexed++ >= n)
+            n <<= 1;
+    }
+    q->nindexed = 0;
+
+    q->buckets = malloc(n * sizeof(struct hlist_head));
+    if (q->buckets == NULL)
+        return false;
+    q->nbuckets = n;
+    for (size_t i = 0; i < n; i++)
+        INIT_HLIST_HEAD(&q->buckets[i]);
+    list_for_each (node, head) {
+        if (!index_add(head, list_entry(node, element_t, list))) {
+            index_clear(q);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Return the number of bytes spent on the hash index of queue.
+ */
+size_t q_index_bytes(struct list_head *head)
+{
+    if (head == NULL || to_queue(head)->buckets == NULL)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    return q->nbuckets * sizeof(struct hlist_head) +
+           q->nindexed * sizeof(index_node_t);
+}
+
+/*
+ * Find an element whose string equals s, leaving it in place.
+ * Return NULL if q is NULL or no element matches.
+ */
+element_t *q_find(struct list_head *head, const char *s)
+{
+    if (head == NULL || s == NULL)
+        return NULL;
+
+    queue_t *q = to_queue(head);
+    element_t *e;
+    if (q->buckets != NULL) {
+        index_node_t *in;
+        hlist_for_each_entry (in, index_bucket(q, s), hnode) {
+            if (value_equal(in->elem->value, s))
+                return in->elem;
+        }
+        return NULL;
+    }
+
+    list_for_each_entry (e, head, list) {
+        if (value_equal(e->value, s))
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * Return whether queue holds an element whose string equals s.
+ */
+bool q_contains(struct list_head *head, const char *s)
+{
+    return q_find(head, s) != NULL;
+}
+
+/*
+ * Attempt to remove an element whose string equals s from queue.
+ * Return target element, or NULL if q is NULL or no element matches.
+ */
+element_t *q_remove_value(struct list_head *head, const char *s)
+{
+    element_t *e = q_find(head, s);
+    if (e == NULL)
+        return NULL;
+
+    list_del(&e->list);
+    index_del(head, e);
+    return e;
+}
+
 /*
  * Attempt to swap every two adjacent nodes.
  */
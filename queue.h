@@ -19,6 +19,8 @@ typedef struct {
      */
     char *value;
     struct list_head list;
+    /* Whether value is shared through the interning pool, see q_set_intern */
+    bool interned;
 } element_t;
 
 /* Operations on queue */
@@ -53,6 +55,56 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/*
+ * Attempt to insert element at head of queue without copying the string.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ * Argument s must have been allocated with malloc/strdup (i.e., through the
+ * test harness allocator). On success the queue takes ownership of s and
+ * releases it together with the element. On failure the caller still owns s.
+ */
+bool q_insert_head_owned(struct list_head *head, char *s);
+
+/*
+ * Attempt to insert element at tail of queue without copying the string.
+ * Other attribute is as same as q_insert_head_owned.
+ */
+bool q_insert_tail_owned(struct list_head *head, char *s);
+
+/*
+ * Attempt to insert n elements at head of queue in one batch.
+ * The result is the same as calling q_insert_head on strs[0] .. strs[n - 1]
+ * in turn, i.e., strs[n - 1] ends up at the head.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space. In that case the
+ * queue is left untouched: either all n strings are inserted or none are.
+ * Every string is copied, as in q_insert_head.
+ */
+bool q_insert_head_n(struct list_head *head,
+                     const char *const *strs,
+                     size_t n);
+
+/*
+ * Attempt to insert n elements at tail of queue in one batch.
+ * The result is the same as calling q_insert_tail on strs[0] .. strs[n - 1]
+ * in turn. Other attribute is as same as q_insert_head_n.
+ */
+bool q_insert_tail_n(struct list_head *head,
+                     const char *const *strs,
+                     size_t n);
+
+/*
+ * Attempt to insert n copies of string s at head of queue in one batch.
+ * Other attribute is as same as q_insert_head_n.
+ */
+bool q_insert_head_repeat(struct list_head *head, const char *s, size_t n);
+
+/*
+ * Attempt to insert n copies of string s at tail of queue in one batch.
+ * Other attribute is as same as q_insert_head_n.
+ */
+bool q_insert_tail_repeat(struct list_head *head, const char *s, size_t n);
+
 /*
  * Attempt to remove element from head of queue.
  * Return target element.
@@ -75,11 +127,42 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove element from head of queue and hand back its string.
+ * Return the string stored in the removed element.
+ * Return NULL if queue is NULL or empty.
+ * The element itself is freed, but the string is not copied: the caller
+ * becomes the owner of the returned string and must free it.
+ */
+char *q_remove_head_owned(struct list_head *head);
+
+/*
+ * Attempt to remove element from tail of queue and hand back its string.
+ * Other attribute is as same as q_remove_head_owned.
+ */
+char *q_remove_tail_owned(struct list_head *head);
+
+/*
+ * Attempt to remove up to n elements from head of queue in one batch.
+ * Return the number of elements removed, which is less than n only when the
+ * queue holds fewer than n elements. Return 0 if queue is NULL or empty.
+ * The removed elements are stored in out[0] .. out[ret - 1] in queue order.
+ *
+ * As with q_remove_head, nothing is freed: the caller owns the removed
+ * elements and may release them with q_release_elements.
+ */
+size_t q_remove_head_n(struct list_head *head, element_t **out, size_t n);
+
 /*
  * Attempt to release element.
  */
 void q_release_element(element_t *e);
 
+/*
+ * Attempt to release n elements stored in array out.
+ */
+void q_release_elements(element_t **out, size_t n);
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
@@ -114,6 +197,53 @@ bool q_delete_dup(struct list_head *head);
  */
 void q_swap(struct list_head *head);
 
+/*
+ * Build or drop the hash index of queue.
+ * While the index exists, every operation that adds or removes elements
+ * keeps it up to date, so q_contains and q_remove_value take O(1) expected
+ * time instead of walking the queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space for the index.
+ */
+bool q_index_enable(struct list_head *head, bool enable);
+
+/*
+ * Return the number of bytes spent on the hash index of queue: the bucket
+ * array, plus a chain node allocated for every element while it is on.
+ * Return 0 if q is NULL or not indexed.
+ */
+size_t q_index_bytes(struct list_head *head);
+
+/*
+ * Return an element whose string equals s, which stays linked in queue.
+ * Callers may move it around with list_move and friends, but must not change
+ * its string. When several elements match, any one of them may be picked.
+ * Return NULL if q is NULL or no element matches.
+ */
+element_t *q_find(struct list_head *head, const char *s);
+
+/*
+ * Return whether queue holds an element whose string equals s.
+ * Return false if q is NULL or empty.
+ */
+bool q_contains(struct list_head *head, const char *s);
+
+/*
+ * Attempt to remove an element whose string equals s from queue.
+ * Return target element, which like in q_remove_head is unlinked but not
+ * freed. When several elements match, any one of them may be picked.
+ * Return NULL if q is NULL or no element matches.
+ */
+element_t *q_remove_value(struct list_head *head, const char *s);
+
+/*
+ * Enable or disable string interning for newly inserted elements.
+ * While enabled, elements holding equal strings share one immutable,
+ * reference-counted copy from a string pool instead of owning a private one.
+ * Elements inserted earlier keep their strings; both kinds may be mixed.
+ */
+void q_set_intern(bool enable);
+
 /*
  * Reverse elements in queue
  * No effect if q is NULL or empty
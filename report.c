@@ -44,6 +44,11 @@ void set_verblevel(int level)
     verblevel = level;
 }
 
+void set_report_file(FILE *f)
+{
+    init_files(f ? f : stdout, f ? f : stdout);
+}
+
 bool set_logfile(char *file_name)
 {
     logfile = fopen(file_name, "w");
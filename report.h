@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 /* Default reporting level.  Must recompile when change */
 #ifndef RPT
@@ -19,6 +20,9 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL } message_t;
 
 bool set_logfile(char *file_name);
 
+/* Send reports to f instead of stdout, or back to stdout if f is NULL */
+void set_report_file(FILE *f);
+
 extern int verblevel;
 void set_verblevel(int level);
 
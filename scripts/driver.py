@@ -4,6 +4,8 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import os
+import tempfile
 
 
 
@@ -16,6 +18,9 @@ class Tracer:
     verbLevel = 0
     autograde = False
     useValgrind = False
+    useGuard = False
+    useCompiled = False
+    usePipelined = False
     colored = False
 
     traceDict = {
@@ -35,7 +40,21 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-batch",
+        19: "trace-19-intern",
+        20: "trace-20-index",
+        21: "trace-21-lru",
+        22: "trace-22-pq",
+        23: "trace-23-delay",
+        24: "trace-24-mpmc",
+        25: "trace-25-steal",
+        26: "trace-26-blocking",
+        27: "trace-27-check",
+        28: "trace-28-fault",
+        29: "trace-29-memstats",
+        30: "trace-30-budget",
+        31: "trace-31-repeat"
     }
 
     traceProbs = {
@@ -55,10 +74,24 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28",
+        29: "Trace-29",
+        30: "Trace-30",
+        31: "Trace-31"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,12 +102,18 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
+                 useGuard=False,
+                 useCompiled=False,
+                 usePipelined=False,
                  colored=False):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
+        self.useGuard = useGuard
+        self.useCompiled = useCompiled
+        self.usePipelined = usePipelined
         self.colored = colored
 
     def printInColor(self, text, color):
@@ -88,6 +127,16 @@ class Tracer:
             return False
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
+        qbcname = None
+        if self.useCompiled:
+            fd, qbcname = tempfile.mkstemp(suffix=".qbc")
+            os.close(fd)
+            clist = [self.qtest, "--compile", fname, qbcname]
+            if subprocess.call(clist, stdout=subprocess.DEVNULL) != 0:
+                self.printInColor("Could not compile '%s'" % fname, self.RED)
+                os.remove(qbcname)
+                return False
+            fname = qbcname
         clist = self.command + ["-v", vname, "-f", fname]
 
         try:
@@ -95,6 +144,9 @@ class Tracer:
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
             return False
+        finally:
+            if qbcname:
+                os.remove(qbcname)
         return retcode == 0
 
     def run(self, tid=0):
@@ -113,6 +165,13 @@ class Tracer:
             self.command = ['valgrind', self.qtest]
         else:
             self.command = [self.qtest]
+        if self.useValgrind:
+            # Valgrind is far too slow for the time budgets
+            self.command.append('-n')
+        if self.useGuard:
+            self.command.append('-g')
+        if self.usePipelined:
+            self.command.append('-p')
         for t in tidList:
             tname = self.traceDict[t]
             if self.verbLevel > 0:
@@ -145,11 +204,14 @@ class Tracer:
 
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [--guard] [--compiled] [--pipelined] [-c]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
+    print("  --guard   Place blocks against guard pages")
+    print("  --compiled Replay the traces compiled into bytecode")
+    print("  --pipelined Read each trace in another thread while it runs")
     print("  -c Enable colored text")
     sys.exit(0)
 
@@ -161,9 +223,12 @@ def run(name, args):
     levelFixed = False
     autograde = False
     useValgrind = False
+    useGuard = False
+    useCompiled = False
+    usePipelined = False
     colored = False
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind', 'guard', 'compiled', 'pipelined'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -178,6 +243,12 @@ def run(name, args):
             autograde = True
         elif opt == '--valgrind':
             useValgrind = True
+        elif opt == '--guard':
+            useGuard = True
+        elif opt == '--compiled':
+            useCompiled = True
+        elif opt == '--pipelined':
+            usePipelined = True
         elif opt == '-c':
             colored = True
         else:
@@ -189,6 +260,9 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
+               useGuard=useGuard,
+               useCompiled=useCompiled,
+               usePipelined=usePipelined,
                colored=colored)
     t.run(tid)
 
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+# Check that qtest -s keeps serving while clients quit and source files
+
+from __future__ import print_function
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def converse(path, lines):
+    """Send lines over a new connection, and return all it gets back"""
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    s.sendall(("\n".join(lines) + "\n").encode())
+    s.shutdown(socket.SHUT_WR)
+    out = b""
+    while True:
+        data = s.recv(65536)
+        if not data:
+            break
+        out += data
+    s.close()
+    return out.decode()
+
+
+def check(name, out, want):
+    if want in out:
+        return True
+    print("FAIL: %s, expected '%s' in:\n%s" % (name, want, out))
+    return False
+
+
+def main(qtest):
+    tmp = tempfile.mkdtemp()
+    path = os.path.join(tmp, "qtest.sock")
+    src = os.path.join(tmp, "src.cmd")
+    with open(src, "w") as f:
+        f.write("ih b\nih a\n")
+
+    server = subprocess.Popen([qtest, "-v", "1", "-s", path],
+                              stdout=subprocess.DEVNULL)
+    for _ in range(100):
+        if os.path.exists(path):
+            break
+        time.sleep(0.05)
+
+    ok = True
+    try:
+        ok &= check("new", converse(path, ["new"]), ":ok")
+        # Neither quit may stop the server, nor let "ih x" run
+        ok &= check("time quit", converse(path, ["time quit", "ih x"]),
+                    "Delta time")
+        converse(path, ["repeat 2 {", "quit", "}", "ih x"])
+        out = converse(path, ["source " + src, "show"])
+        ok &= check("source", out, "l = [a b]\n")
+        ok &= check("server alive", str(server.poll()), "None")
+    except OSError as e:
+        print("FAIL: server went away: %s" % e)
+        ok = False
+    finally:
+        server.terminate()
+        ok &= server.wait() == 0
+        os.remove(src)
+        if os.path.exists(path):
+            os.remove(path)
+        os.rmdir(tmp)
+
+    print("--- server " + ("OK" if ok else "FAILED"))
+    return ok
+
+
+if __name__ == "__main__":
+    sys.exit(0 if main(sys.argv[1] if len(sys.argv) > 1 else "./qtest")
+             else 1)
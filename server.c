@@ -0,0 +1,344 @@
+/* Unix-domain socket server for the console */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "list.h"
+#include "report.h"
+#include "server.h"
+
+/* Free space to make in a client's input buffer before each read */
+#define SERVER_READ 65536
+
+/* Stop reading from a client that has this much output it has not taken */
+#define SERVER_OUT_MAX (1 << 20)
+
+/* Events to take from each epoll_wait */
+#define SERVER_EVENTS 64
+
+typedef struct {
+    int fd;
+    uint32_t events; /* What epoll watches for */
+    bool eof;        /* Nothing more to read */
+    bool closing;    /* Close once the output is sent */
+    char *in;        /* Input not run yet */
+    size_t in_len, in_size;
+    char *out; /* Output not sent yet, from out_pos on */
+    size_t out_len, out_pos, out_size;
+    struct list_head list;
+} client_t;
+
+static int epfd = -1;
+static LIST_HEAD(clients);
+
+/*
+ * Repeat blocks belong to the interpreter, not to a client, so while one
+ * client is in the middle of one, the others' lines are held back.
+ */
+static client_t *owner = NULL;
+static bool deferred = false;
+
+/* Responses to the lines of one read are collected here */
+static FILE *out_stream = NULL;
+static char *out_buf = NULL;
+static size_t out_buf_len = 0;
+
+static volatile sig_atomic_t stop = 0;
+
+static void stop_handler(int sig)
+{
+    stop = 1;
+}
+
+/* Make room for need bytes in a buffer */
+static void buf_reserve(char **buf, size_t *size, size_t len, size_t need)
+{
+    if (need <= *size)
+        return;
+
+    size_t n = *size ? *size : SERVER_READ;
+    while (n < need)
+        n *= 2;
+    char *nbuf = malloc_or_fail(n, "buf_reserve");
+    if (*buf) {
+        memcpy(nbuf, *buf, len);
+        free_block(*buf, *size);
+    }
+    *buf = nbuf;
+    *size = n;
+}
+
+static void client_watch(client_t *c)
+{
+    size_t pending = c->out_len - c->out_pos;
+    bool more = !c->eof && !c->closing && pending < SERVER_OUT_MAX;
+    uint32_t events = (pending ? EPOLLOUT : 0) | (more ? EPOLLIN : 0);
+    if (events == c->events)
+        return;
+
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+static void client_close(client_t *c)
+{
+    if (owner == c) {
+        report(1, "Dropping unfinished repeat block of closed client");
+        discard_block();
+        owner = NULL;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    list_del(&c->list);
+    if (c->in)
+        free_block(c->in, c->in_size);
+    if (c->out)
+        free_block(c->out, c->out_size);
+    free_block(c, sizeof(client_t));
+}
+
+/* Send what output the client takes, return false if it got closed */
+static bool client_flush(client_t *c)
+{
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            client_close(c);
+            return false;
+        }
+        c->out_pos += n;
+    }
+
+    if (c->out_pos == c->out_len) {
+        c->out_pos = c->out_len = 0;
+        if (c->closing) {
+            client_close(c);
+            return false;
+        }
+    }
+    client_watch(c);
+    return true;
+}
+
+/* Run the complete lines a client has sent, return false if it got closed */
+static bool client_run(client_t *c)
+{
+    char *line = c->in;
+    char *end = c->in + c->in_len;
+    char *nl;
+
+    fseek(out_stream, 0, SEEK_SET);
+    set_report_file(out_stream);
+    while (!c->closing && (!owner || owner == c) &&
+           (nl = memchr(line, '\n', end - line))) {
+        *nl = '\0';
+        bool quit;
+        bool ok = interpret_line(line, &quit);
+        fputs(ok ? ":ok\n" : ":err\n", out_stream);
+        owner = block_pending() ? c : NULL;
+        c->closing = quit;
+        line = nl + 1;
+    }
+    set_report_file(NULL);
+    fflush(out_stream);
+
+    bool held = memchr(line, '\n', end - line) != NULL;
+    if (held && owner && owner != c)
+        deferred = true;
+    c->in_len = end - line;
+    memmove(c->in, line, c->in_len);
+    if (c->eof && !held)
+        c->closing = true;
+
+    if (out_buf_len) {
+        buf_reserve(&c->out, &c->out_size, c->out_len,
+                    c->out_len + out_buf_len);
+        memcpy(c->out + c->out_len, out_buf, out_buf_len);
+        c->out_len += out_buf_len;
+    }
+    return client_flush(c);
+}
+
+/* Read once from a client, and answer what it has sent */
+static void client_read(client_t *c)
+{
+    buf_reserve(&c->in, &c->in_size, c->in_len, c->in_len + SERVER_READ + 1);
+    ssize_t n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len - 1);
+    if (n < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            client_close(c);
+        return;
+    }
+
+    c->in_len += n;
+    if (!n) {
+        /* Take a last line without a newline, and hang up once it has run */
+        if (c->in_len && c->in[c->in_len - 1] != '\n')
+            c->in[c->in_len++] = '\n';
+        c->eof = true;
+    }
+    client_run(c);
+}
+
+/* Run the lines held back while another client had a block open */
+static void run_deferred()
+{
+    client_t *c, *safe;
+    deferred = false;
+    list_for_each_entry_safe (c, safe, &clients, list) {
+        if (owner)
+            break;
+        if (memchr(c->in, '\n', c->in_len))
+            client_run(c);
+    }
+    if (owner)
+        deferred = true;
+}
+
+static void accept_clients(int lfd)
+{
+    while (true) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                report(1, "accept failed: %s", strerror(errno));
+            return;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        client_t *c = malloc_or_fail(sizeof(client_t), "accept_clients");
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->events = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            free_block(c, sizeof(client_t));
+            continue;
+        }
+        list_add_tail(&c->list, &clients);
+    }
+}
+
+static int listen_at(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        report(1, "Socket path '%s' is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        report(1, "socket failed: %s", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, SOMAXCONN)) {
+        report(1, "Could not listen at '%s': %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool run_server(const char *path)
+{
+    int lfd = listen_at(path);
+    if (lfd < 0)
+        return false;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    out_stream = open_memstream(&out_buf, &out_buf_len);
+    if (epfd < 0 || !out_stream || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev)) {
+        report(1, "Could not set up server: %s", strerror(errno));
+        if (out_stream)
+            fclose(out_stream);
+        free(out_buf);
+        if (epfd >= 0)
+            close(epfd);
+        close(lfd);
+        unlink(path);
+        return false;
+    }
+
+    /* No SA_RESTART, so that epoll_wait returns to check stop */
+    struct sigaction sa, old_int, old_term;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    report(1, "Listening at %s", path);
+    struct epoll_event events[SERVER_EVENTS];
+    while (!stop) {
+        int n = epoll_wait(epfd, events, SERVER_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            report(1, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            client_t *c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(lfd);
+                continue;
+            }
+            /*
+             * A client that hung up while its lines were held back cannot
+             * take the responses, and would keep being reported.
+             */
+            if (c->eof && (events[i].events & (EPOLLHUP | EPOLLERR)))
+                client_close(c);
+            else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                client_read(c);
+            else if (events[i].events & EPOLLOUT)
+                client_flush(c);
+        }
+        if (deferred && !owner)
+            run_deferred();
+    }
+
+    client_t *c, *safe;
+    list_for_each_entry_safe (c, safe, &clients, list) {
+        if (client_flush(c))
+            client_close(c);
+    }
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    fclose(out_stream);
+    free(out_buf);
+    out_stream = NULL;
+    out_buf = NULL;
+    close(epfd);
+    epfd = -1;
+    close(lfd);
+    unlink(path);
+    return true;
+}
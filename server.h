@@ -0,0 +1,25 @@
+#ifndef LAB0_SERVER_H
+#define LAB0_SERVER_H
+
+/*
+ * Serve the console over a Unix-domain socket.
+ *
+ * Any number of local clients may connect and send command lines, all of
+ * them run by the one interpreter, on the same queue.  A client does not
+ * have to wait for one command to finish before sending the next.  The
+ * output of each command, followed by a line reading ":ok" or ":err", is
+ * sent back in order, with the responses to everything one read brought in
+ * going out together.  Running quit, even through time, a sourced file or
+ * a repeat block, closes only the connection it came from.
+ */
+
+#include <stdbool.h>
+
+/*
+ * Listen at path, replacing any socket already there, and run commands
+ * until interrupted by SIGINT or SIGTERM.  Return false if could not
+ * listen.
+ */
+bool run_server(const char *path);
+
+#endif /* LAB0_SERVER_H */
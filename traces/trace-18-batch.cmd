@@ -0,0 +1,17 @@
+# Test of batched insertion, batched removal and ownership transfer
+new
+ih dolphin 3
+it -m gerbil 2
+ih -m bear
+rhn 2
+rh dolphin
+rhn 0
+rt -m gerbil
+rh -m dolphin
+rh gerbil
+it RAND 5
+rhn 10
+size
+ih meerkat 4
+rhn 4
+free
@@ -0,0 +1,20 @@
+# Test of string interning with insert, remove, sort, and delete duplicate
+option intern 1
+new
+ih gerbil 3
+it lion 2
+it -m gerbil
+ih zebra
+it ZIPF 10
+sort
+dedup
+free
+new
+ih bear 2
+it dolphin
+rh -m bear
+rt dolphin
+rhn 1
+size
+free
+option intern 0
@@ -0,0 +1,23 @@
+# Test of hash index with find, remove by value, and delete duplicate
+new
+ih dolphin
+it bear
+it gerbil 2
+find bear
+index 1
+it meerkat
+ih bear
+find meerkat
+rv bear
+find bear
+rv bear
+find bear
+rv vulture
+sort
+dedup
+find gerbil
+rv gerbil
+find gerbil
+index 0
+rv dolphin
+free
@@ -0,0 +1,20 @@
+# Test of LRU cache with get, put, evict, and Zipf replay
+lru 3
+lput gerbil
+lput bear
+lput dolphin
+lget gerbil
+lput meerkat
+lget bear
+lget gerbil
+lget dolphin
+levict
+lget dolphin
+lput bear
+lru
+levict
+levict
+levict
+lru 50
+lbench 5000
+lru 0
@@ -0,0 +1,20 @@
+# Test of priority queue with insert, peek, and pop
+pqpop
+pqins dolphin
+pqins Bear
+pqins gerbil
+pqins meerkat
+pqpeek Bear
+pqins aardvark
+pqpeek aardvark
+pqpop aardvark
+pqpop Bear
+pqins cat
+pqpop cat
+pqpop dolphin
+pqins RAND 500
+pqpop
+pqpop
+pqins ZIPF 50
+pqpop
+pqbench 2000 100
@@ -0,0 +1,30 @@
+# Test of delayed insertion with schedule, cancel, and clock ticks
+new
+it dolphin
+dq bear 3
+dq gerbil 1
+dq meerkat 70
+dq vulture 5000
+dq zebra 0
+tick
+rh dolphin
+rh zebra
+rh gerbil
+tick 2
+rh bear
+dcancel 3
+dcancel 3
+tick 100
+tick 4900
+rh vulture
+dq RAND 20 10
+tick 19
+tick
+rhn 10
+free
+dq lion 2
+tick 2
+new
+tick
+rh lion
+free
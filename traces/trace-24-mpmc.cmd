@@ -0,0 +1,5 @@
+# Test of lock-free queue with concurrent producers and consumers
+mpmc 2000
+mpmc 5000 1
+mpmc 500 16
+mpmcbench 10000
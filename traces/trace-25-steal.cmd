@@ -0,0 +1,15 @@
+# Test of work-stealing pool with parallel sort and fork/join
+new
+it gerbil
+it Bear
+it dolphin
+it apple
+psort 2
+rh apple
+free
+new
+it RAND 20000
+psort 4
+psort 1
+free
+fjbench 20 4
@@ -0,0 +1,8 @@
+# Test of blocking bounded queue with producers and consumers
+bqbench 1 1 2000
+bqbench 4 2 1000 16 4
+bqbench 2 4 1000 1 1
+bqbench 3 3 1000 8 64
+# Fewer strings than a batch must still reach consumers waiting forever
+bqbench 1 1 3 1024 16
+bqbench 2 1 5 64 16
@@ -0,0 +1,18 @@
+# Test harness checking levels, switching between them with blocks live
+option fail 0
+option malloc 0
+option check 0
+new
+ih dolphin 1000
+it gerbil 1000
+rh dolphin
+option check 1
+option sample 4
+ih RAND 1000
+sort
+option check 2
+rt
+reverse
+option check 3
+option sample 0
+free
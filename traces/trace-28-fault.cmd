@@ -0,0 +1,20 @@
+# Test scheduled malloc failures, which must be replayable exactly
+option fail 100
+option seed 7
+new
+fault nth 3
+ih a
+ih b
+ih c
+ih d
+fault op 2
+ih e 3
+it f
+rh e
+fault off
+option malloc 40
+ih RAND 20
+it gerbil 20
+option malloc 0
+fault
+free
@@ -0,0 +1,12 @@
+# Test allocation profiling across queue operations
+option fail 0
+option malloc 0
+new
+ih dolphin 100
+it RAND 50
+rh dolphin
+dedup
+pqins RAND 10
+memstats
+free
+memstats
@@ -0,0 +1,14 @@
+# Test microsecond time budgets: constant-time operations on a long queue
+option fail 0
+option malloc 0
+new
+ih dolphin 200000
+option budget 50000
+it gerbil
+ih gerbil
+rh gerbil
+rt gerbil
+size
+budget
+option budget 1000000
+free
@@ -0,0 +1,24 @@
+# Test repeat blocks, with nested counters substituted into arguments
+option fail 0
+option malloc 0
+new
+repeat 3 {
+  it a$i
+  repeat 2 j {
+    ih b$i.$j
+  }
+}
+size
+rh b2.1
+rt a2
+repeat 100000 {
+  ih dolphin$i
+  rh dolphin$i
+  it gerbil
+  rt gerbil
+}
+size
+repeat 0 {
+  it never
+}
+free
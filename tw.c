@@ -0,0 +1,197 @@
+/* Hierarchical timing wheel feeding a ready queue */
+
+#include <stdlib.h>
+
+#include "harness.h"
+#include "queue.h"
+#include "tw.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+/* Initial number of identifier buckets, must be a power of 2 */
+#define TW_MIN_IDS 64
+
+typedef struct {
+    struct list_head node;   /* Bucket of the wheel, or the due list */
+    struct hlist_node hnode; /* Chain of the identifier lookup */
+    uint64_t id;
+    uint64_t expires;
+    char *value;
+} tw_timer_t;
+
+static inline struct hlist_head *id_bucket(tw_t *tw, uint64_t id)
+{
+    /* Fibonacci hashing, since identifiers are sequential */
+    return &tw->ids[(id * 11400714819323198485ull) >> 32 & (tw->nids - 1)];
+}
+
+/* Double the identifier buckets once the load factor exceeds one */
+static bool ids_grow(tw_t *tw)
+{
+    size_t n = tw->nids ? tw->nids << 1 : TW_MIN_IDS;
+    struct hlist_head *old = tw->ids;
+    size_t oldn = tw->nids;
+    struct hlist_head *nb = malloc(n * sizeof(struct hlist_head));
+    if (!nb)
+        return false;
+    for (size_t i = 0; i < n; i++)
+        INIT_HLIST_HEAD(&nb[i]);
+
+    tw->ids = nb;
+    tw->nids = n;
+    for (size_t i = 0; i < oldn; i++) {
+        struct hlist_node *node, *safe;
+        hlist_for_each_safe (node, safe, &old[i]) {
+            tw_timer_t *t = hlist_entry(node, tw_timer_t, hnode);
+            hlist_add_head(node, id_bucket(tw, t->id));
+        }
+    }
+    free(old);
+    return true;
+}
+
+/* Put t in the bucket matching its distance from now */
+static void place(tw_t *tw, tw_timer_t *t)
+{
+    uint64_t delta = t->expires > tw->now ? t->expires - tw->now : 0;
+    uint64_t expires = t->expires;
+    int level = 0;
+
+    while (level < TW_LEVELS - 1 && delta >> (TW_BITS * (level + 1)))
+        level++;
+    /* Beyond the span of the wheel, wait in the top level and re-place */
+    if (delta >> (TW_BITS * TW_LEVELS))
+        expires = tw->now + (1ull << (TW_BITS * TW_LEVELS)) - 1;
+
+    size_t slot = (expires >> (TW_BITS * level)) & TW_MASK;
+    list_add_tail(&t->node, &tw->wheel[level][slot]);
+}
+
+/* Drop t from the identifier lookup and free it */
+static void timer_free(tw_t *tw, tw_timer_t *t)
+{
+    hlist_del(&t->hnode);
+    free(t);
+    /* Hand the buckets back once idle, so that no blocks stay allocated */
+    if (!--tw->pending) {
+        free(tw->ids);
+        tw->ids = NULL;
+        tw->nids = 0;
+    }
+}
+
+void tw_init(tw_t *tw)
+{
+    tw->now = 0;
+    tw->nextid = 1;
+    tw->pending = 0;
+    INIT_LIST_HEAD(&tw->due);
+    for (int l = 0; l < TW_LEVELS; l++) {
+        for (int s = 0; s < TW_SLOTS; s++)
+            INIT_LIST_HEAD(&tw->wheel[l][s]);
+    }
+    tw->ids = NULL;
+    tw->nids = 0;
+}
+
+void tw_clear(tw_t *tw)
+{
+    for (size_t i = 0; tw->pending && i < tw->nids; i++) {
+        struct hlist_node *node, *safe;
+        hlist_for_each_safe (node, safe, &tw->ids[i]) {
+            tw_timer_t *t = hlist_entry(node, tw_timer_t, hnode);
+            list_del(&t->node);
+            free(t->value);
+            timer_free(tw, t);
+        }
+    }
+    tw_init(tw);
+}
+
+uint64_t tw_schedule(tw_t *tw, char *s, uint64_t delay)
+{
+    if (!s)
+        return 0;
+    if (tw->pending >= tw->nids && !ids_grow(tw) && !tw->nids)
+        return 0;
+
+    tw_timer_t *t = malloc(sizeof(tw_timer_t));
+    if (!t) {
+        /* Do not keep empty buckets around */
+        if (!tw->pending) {
+            free(tw->ids);
+            tw->ids = NULL;
+            tw->nids = 0;
+        }
+        return 0;
+    }
+    t->id = tw->nextid++;
+    t->expires = tw->now + delay;
+    t->value = s;
+    hlist_add_head(&t->hnode, id_bucket(tw, t->id));
+    tw->pending++;
+
+    if (delay)
+        place(tw, t);
+    else
+        list_add_tail(&t->node, &tw->due);
+    return t->id;
+}
+
+char *tw_cancel(tw_t *tw, uint64_t id)
+{
+    if (!tw->pending)
+        return NULL;
+
+    tw_timer_t *t;
+    hlist_for_each_entry (t, id_bucket(tw, id), hnode) {
+        if (t->id == id) {
+            char *s = t->value;
+            list_del(&t->node);
+            timer_free(tw, t);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Advance the clock one tick, moving the timers expiring now to due */
+static void tick(tw_t *tw)
+{
+    tw->now++;
+    for (int level = 1; level < TW_LEVELS; level++) {
+        if (tw->now & ((1ull << (TW_BITS * level)) - 1))
+            break;
+
+        struct list_head *slot =
+            &tw->wheel[level][(tw->now >> (TW_BITS * level)) & TW_MASK];
+        struct list_head *node, *safe;
+        list_for_each_safe (node, safe, slot) {
+            list_del(node);
+            place(tw, list_entry(node, tw_timer_t, node));
+        }
+    }
+    list_splice_tail_init(&tw->wheel[0][tw->now & TW_MASK], &tw->due);
+}
+
+size_t tw_advance(tw_t *tw, uint64_t ticks, struct list_head *ready)
+{
+    /* An idle wheel has nothing to cascade, so the clock may jump */
+    if (!tw->pending)
+        tw->now += ticks;
+    else {
+        while (ticks--)
+            tick(tw);
+    }
+
+    size_t cnt = 0;
+    while (ready && !list_empty(&tw->due)) {
+        tw_timer_t *t = list_first_entry(&tw->due, tw_timer_t, node);
+        if (!q_insert_tail_owned(ready, t->value))
+            break;
+        list_del(&t->node);
+        timer_free(tw, t);
+        cnt++;
+    }
+    return cnt;
+}
@@ -0,0 +1,67 @@
+#ifndef LAB0_TW_H
+#define LAB0_TW_H
+
+/*
+ * Delayed queue built on a hierarchical timing wheel.
+ *
+ * Strings are scheduled to become ready a number of ticks in the future and
+ * are moved to the tail of a normal queue once the simulated clock gets
+ * there.  The wheel has TW_LEVELS levels of TW_SLOTS buckets each, every
+ * bucket being a list_head list; a level covers TW_SLOTS times the span of
+ * the one below, and its buckets are cascaded into the lower levels as the
+ * clock reaches them.  Scheduling and cancelling take O(1) expected time,
+ * and every timer is cascaded at most TW_LEVELS - 1 times before it expires.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "list.h"
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+typedef struct {
+    uint64_t now;    /* Simulated clock, in ticks */
+    uint64_t nextid; /* Identifier of the next scheduled timer */
+    size_t pending;  /* Timers scheduled but not delivered yet */
+    struct list_head due; /* Expired timers waiting for delivery */
+    struct list_head wheel[TW_LEVELS][TW_SLOTS];
+    struct hlist_head *ids; /* Lookup by identifier for tw_cancel */
+    size_t nids;
+} tw_t;
+
+/* Initialize an empty delayed queue with the clock at tick 0 */
+void tw_init(tw_t *tw);
+
+/* Free all pending strings and leave the delayed queue empty */
+void tw_clear(tw_t *tw);
+
+/*
+ * Schedule s to become ready delay ticks from now, taking ownership of it:
+ * s must come from the test harness allocator, like the strings handed to
+ * q_insert_tail_owned.  A delay of 0 makes s ready at the next tw_advance.
+ * Return a nonzero identifier for tw_cancel, or 0 if s is NULL or could not
+ * allocate space, in which case s still belongs to the caller.
+ */
+uint64_t tw_schedule(tw_t *tw, char *s, uint64_t delay);
+
+/*
+ * Cancel the pending timer id.
+ * Return its string, which the caller must free, or NULL if no such timer is
+ * pending.
+ */
+char *tw_cancel(tw_t *tw, uint64_t id);
+
+/*
+ * Advance the clock by ticks and append the strings of all expired timers to
+ * the tail of ready, in order of expiry.  Timers that could not be delivered
+ * for lack of memory, or because ready is NULL, stay due and are retried by
+ * the next call.
+ * Return the number of strings delivered.
+ */
+size_t tw_advance(tw_t *tw, uint64_t ticks, struct list_head *ready);
+
+#endif /* LAB0_TW_H */
@@ -0,0 +1,320 @@
+/* Chase-Lev work-stealing deque and fork/join pool */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ws.h"
+
+/* Deques need cache line alignment and the pool owns threads, so use libc */
+#define INTERNAL 1
+#include "harness.h"
+
+#define CACHE_LINE 64
+
+/* Failed steal rounds before an idle worker yields the processor */
+#define WS_SPINS 64
+
+typedef struct ws_array {
+    struct ws_array *prev; /* Outgrown array, freed with the deque */
+    int64_t mask;
+    void *buf[];
+} ws_array_t;
+
+struct ws_deque {
+    int64_t top __attribute__((aligned(CACHE_LINE)));    /* Steal end */
+    int64_t bottom __attribute__((aligned(CACHE_LINE))); /* Owner end */
+    ws_array_t *array;
+};
+
+static ws_array_t *array_new(int64_t size)
+{
+    ws_array_t *a = test_malloc(sizeof(ws_array_t) + size * sizeof(void *));
+    if (!a)
+        return NULL;
+    a->prev = NULL;
+    a->mask = size - 1;
+    return a;
+}
+
+ws_deque_t *ws_new(size_t capacity)
+{
+    int64_t size = 16;
+    while ((size_t) size < capacity)
+        size <<= 1;
+
+    ws_deque_t *d;
+    if (posix_memalign((void **) &d, CACHE_LINE, sizeof(ws_deque_t)))
+        return NULL;
+    d->array = array_new(size);
+    if (!d->array) {
+        free(d);
+        return NULL;
+    }
+    d->top = d->bottom = 0;
+    return d;
+}
+
+void ws_free(ws_deque_t *d)
+{
+    if (!d)
+        return;
+    /* Thieves may still read an outgrown array, so all are kept until now */
+    for (ws_array_t *a = d->array, *prev; a; a = prev) {
+        prev = a->prev;
+        test_free(a);
+    }
+    free(d);
+}
+
+static inline void *slot_load(ws_array_t *a, int64_t i)
+{
+    return __atomic_load_n(&a->buf[i & a->mask], __ATOMIC_RELAXED);
+}
+
+static inline void slot_store(ws_array_t *a, int64_t i, void *item)
+{
+    __atomic_store_n(&a->buf[i & a->mask], item, __ATOMIC_RELAXED);
+}
+
+bool ws_insert_head(ws_deque_t *d, void *item)
+{
+    if (!item)
+        return false;
+
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    ws_array_t *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+    if (b - t > a->mask) {
+        ws_array_t *na = array_new((a->mask + 1) << 1);
+        if (!na)
+            return false;
+        for (int64_t i = t; i < b; i++)
+            slot_store(na, i, slot_load(a, i));
+        na->prev = a;
+        __atomic_store_n(&d->array, na, __ATOMIC_RELEASE);
+        a = na;
+    }
+    slot_store(a, b, item);
+    /* Publish the item, and whatever it points to, to the thieves */
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *ws_remove_head(ws_deque_t *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    ws_array_t *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        /* Empty */
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    void *item = slot_load(a, b);
+    if (t == b) {
+        /* Last item, race the thieves for it */
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            item = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+void *ws_remove_tail(ws_deque_t *d)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+
+    ws_array_t *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    void *item = slot_load(a, t);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return item;
+}
+
+typedef struct {
+    ws_pool_t *pool;
+    ws_deque_t *deque;
+    unsigned seed; /* Victim selection */
+    pthread_t tid;
+} ws_worker_t;
+
+struct ws_pool {
+    int nthreads;
+    ws_worker_t *workers; /* Worker 0 is whoever calls ws_pool_run */
+    int running;          /* Whether a root task is in progress */
+    int stop;
+    pthread_mutex_t lock; /* Protects running and stop for the idle wait */
+    pthread_cond_t wake;
+};
+
+static __thread ws_worker_t *ws_self = NULL;
+
+static inline void task_run(ws_task_t *t)
+{
+    t->fn(t);
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+}
+
+/* Run one task from the own deque or a victim's, return false if none */
+static bool work_once(ws_worker_t *w)
+{
+    ws_task_t *t = ws_remove_head(w->deque);
+    if (!t) {
+        ws_pool_t *p = w->pool;
+        int start = rand_r(&w->seed) % p->nthreads;
+        for (int i = 0; !t && i < p->nthreads; i++) {
+            ws_worker_t *v = &p->workers[(start + i) % p->nthreads];
+            if (v != w)
+                t = ws_remove_tail(v->deque);
+        }
+    }
+    if (!t)
+        return false;
+    task_run(t);
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    ws_worker_t *w = arg;
+    ws_pool_t *p = w->pool;
+    ws_self = w;
+
+    while (true) {
+        pthread_mutex_lock(&p->lock);
+        while (!__atomic_load_n(&p->running, __ATOMIC_RELAXED) && !p->stop)
+            pthread_cond_wait(&p->wake, &p->lock);
+        bool stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+
+        for (int idle = 0; __atomic_load_n(&p->running, __ATOMIC_ACQUIRE);) {
+            if (work_once(w))
+                idle = 0;
+            else if (++idle >= WS_SPINS) {
+                sched_yield();
+                idle = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+ws_pool_t *ws_pool_new(int nthreads)
+{
+    if (nthreads < 1)
+        return NULL;
+
+    ws_pool_t *p = calloc(1, sizeof(ws_pool_t));
+    if (!p)
+        return NULL;
+    p->workers = calloc(nthreads, sizeof(ws_worker_t));
+    if (!p->workers) {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        ws_worker_t *w = &p->workers[i];
+        w->pool = p;
+        w->seed = i + 1;
+        w->deque = ws_new(0);
+        if (!w->deque) {
+            ws_pool_free(p);
+            return NULL;
+        }
+        p->nthreads = i + 1;
+    }
+
+    /*
+     * Only started workers are joined by ws_pool_free, while every deque
+     * allocated above is freed, so nthreads stays as it is.
+     */
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&p->workers[i].tid, NULL, worker_main,
+                           &p->workers[i])) {
+            p->workers[i].tid = 0;
+            ws_pool_free(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+void ws_pool_free(ws_pool_t *p)
+{
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 1; i < p->nthreads; i++) {
+        if (p->workers[i].tid)
+            pthread_join(p->workers[i].tid, NULL);
+    }
+    for (int i = 0; i < p->nthreads; i++)
+        ws_free(p->workers[i].deque);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->workers);
+    free(p);
+}
+
+void ws_pool_run(ws_pool_t *p, ws_task_t *root)
+{
+    ws_worker_t *prev = ws_self;
+    ws_self = &p->workers[0];
+
+    pthread_mutex_lock(&p->lock);
+    __atomic_store_n(&p->running, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    root->done = 0;
+    task_run(root);
+
+    /* Forked tasks are all joined before their parents return */
+    __atomic_store_n(&p->running, 0, __ATOMIC_RELEASE);
+    ws_self = prev;
+}
+
+void ws_fork(ws_task_t *t)
+{
+    t->done = 0;
+    if (!ws_self || !ws_insert_head(ws_self->deque, t))
+        task_run(t);
+}
+
+void ws_join(ws_task_t *t)
+{
+    ws_worker_t *w = ws_self;
+    int idle = 0;
+    while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+        if (w && work_once(w))
+            idle = 0;
+        else if (++idle >= WS_SPINS) {
+            sched_yield();
+            idle = 0;
+        }
+    }
+}
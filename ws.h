@@ -0,0 +1,88 @@
+#ifndef LAB0_WS_H
+#define LAB0_WS_H
+
+/*
+ * Work-stealing deque and the fork/join thread pool built on it.
+ *
+ * The deque is the Chase-Lev one: a growable circular array indexed by two
+ * counters, where the owning thread inserts and removes at the head without
+ * locks or, in the common case, atomic read-modify-write operations, while
+ * any other thread may steal from the tail with a single compare-and-swap.
+ * Every worker of a pool owns one deque, pushes the tasks it forks onto it,
+ * and steals from a random victim when it runs dry.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ws_deque ws_deque_t;
+
+/*
+ * Create an empty deque with room for at least capacity items before it
+ * has to grow.
+ * Return NULL if could not allocate space.
+ */
+ws_deque_t *ws_new(size_t capacity);
+
+/* Free all storage used by deque, which no thread may be using */
+void ws_free(ws_deque_t *d);
+
+/*
+ * Insert item at head of deque, growing the array if needed.
+ * Only the owner of d may call this.
+ * Return false if item is NULL or could not allocate space.
+ */
+bool ws_insert_head(ws_deque_t *d, void *item);
+
+/*
+ * Remove the item at head of deque, the one inserted last.
+ * Only the owner of d may call this.
+ * Return NULL if deque is empty.
+ */
+void *ws_remove_head(ws_deque_t *d);
+
+/*
+ * Steal the item at tail of deque, the oldest one.
+ * Any thread may call this.
+ * Return NULL if deque is empty or another thread won the race for the
+ * item, in which case the caller may simply look elsewhere.
+ */
+void *ws_remove_tail(ws_deque_t *d);
+
+/*
+ * A unit of work for the pool, embedded in a caller-defined structure and
+ * recovered with container_of in fn.
+ */
+typedef struct ws_task {
+    void (*fn)(struct ws_task *t);
+    int done;
+} ws_task_t;
+
+typedef struct ws_pool ws_pool_t;
+
+/*
+ * Create a pool of nthreads workers, the thread calling ws_pool_run being
+ * one of them.
+ * Return NULL if could not allocate space or start the threads.
+ */
+ws_pool_t *ws_pool_new(int nthreads);
+
+/* Stop the workers and free the pool */
+void ws_pool_free(ws_pool_t *p);
+
+/* Run root and everything it forks to completion */
+void ws_pool_run(ws_pool_t *p, ws_task_t *root);
+
+/*
+ * Make t available to other workers.  Must be called from a task.  If it
+ * cannot be queued, t is run right away instead.
+ */
+void ws_fork(ws_task_t *t);
+
+/*
+ * Wait for a forked task to finish, running other tasks meanwhile.
+ * Must be called from the task that forked t.
+ */
+void ws_join(ws_task_t *t);
+
+#endif /* LAB0_WS_H */